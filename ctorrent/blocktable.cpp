@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "blocktable.h"
+#include "torrent.h"
+
+#include <string.h>
+#include <math.h>
+
+const size_t BlockTable::None;
+
+BlockTable::Piece::Piece(size_t i, size_t size)
+	: index(i),
+	  receivedBlocks(0),
+	  hashedBlocks(0),
+	  data(size)
+{
+	size_t numBlocks = (size_t)ceil(double(size) / maxRequestSize);
+
+	freeBlocks = numBlocks;
+	blocks.resize(numBlocks, Block { BS_Free, 0, false, 0 });
+	data.setSize(size);
+}
+
+size_t BlockTable::Piece::blockSize(size_t block) const
+{
+	size_t begin = block * maxRequestSize;
+	return std::min<size_t>(maxRequestSize, data.size() - begin);
+}
+
+bool BlockTable::Piece::validBlock(size_t begin, size_t size) const
+{
+	return begin % maxRequestSize == 0
+		&& begin / maxRequestSize < blocks.size()
+		&& size == blockSize(begin / maxRequestSize);
+}
+
+void BlockTable::Piece::request(size_t block, uint32_t from)
+{
+	Block &b = blocks[block];
+	if (b.state == BS_Received)
+		return;
+
+	if (b.state == BS_Free) {
+		b.state = BS_Requested;
+		--freeBlocks;
+	}
+
+	++b.requests;
+	b.peer = from;
+}
+
+void BlockTable::Piece::unrequest(size_t block)
+{
+	Block &b = blocks[block];
+	if (b.state != BS_Requested)
+		return;
+
+	if (--b.requests == 0) {
+		b.state = BS_Free;
+		++freeBlocks;
+	}
+}
+
+uint8_t *BlockTable::Piece::claim(size_t begin, size_t size)
+{
+	if (!validBlock(begin, size))
+		return nullptr;
+
+	Block &b = blocks[begin / maxRequestSize];
+	if (b.state == BS_Received || b.receiving)
+		return nullptr;
+
+	b.receiving = true;
+	return &data[begin];
+}
+
+void BlockTable::Piece::unclaim(size_t begin)
+{
+	blocks[begin / maxRequestSize].receiving = false;
+}
+
+bool BlockTable::Piece::receive(size_t begin, const uint8_t *block, size_t size, uint32_t from)
+{
+	// Someone else is still reading it in place, leave them be
+	Block &b = blocks[begin / maxRequestSize];
+	if (b.state == BS_Received || (b.receiving && block != &data[begin]))
+		return false;
+
+	if (b.state == BS_Free)
+		--freeBlocks;
+
+	if (block != &data[begin])
+		memcpy(&data[begin], block, size);
+	b.state = BS_Received;
+	b.requests = 0;
+	b.receiving = false;
+	b.peer = from;
+	++receivedBlocks;
+
+	while (hashedBlocks < blocks.size() && blocks[hashedBlocks].state == BS_Received) {
+		sha1.update(&data[hashedBlocks * maxRequestSize], blockSize(hashedBlocks));
+		++hashedBlocks;
+	}
+
+	return true;
+}
+
+BlockTable::~BlockTable()
+{
+	clear();
+}
+
+BlockTable::Piece *BlockTable::find(size_t index) const
+{
+	auto it = m_pieces.find(index);
+	if (it == m_pieces.end())
+		return nullptr;
+
+	return it->second;
+}
+
+BlockTable::Piece *BlockTable::add(size_t index, size_t size)
+{
+	Piece *&piece = m_pieces[index];
+	if (!piece)
+		piece = new Piece(index, size);
+	return piece;
+}
+
+void BlockTable::remove(size_t index)
+{
+	auto it = m_pieces.find(index);
+	if (it == m_pieces.end())
+		return;
+
+	delete it->second;
+	m_pieces.erase(it);
+}
+
+void BlockTable::clear()
+{
+	for (const auto &it : m_pieces)
+		delete it.second;
+	m_pieces.clear();
+}
+
+size_t BlockTable::partial(const bitset &peer, const std::function<bool (size_t)> &downloading) const
+{
+	const Piece *best = nullptr;
+	for (const auto &it : m_pieces) {
+		const Piece *p = it.second;
+		if (p->freeBlocks == 0 || !peer.test(p->index) || downloading(p->index))
+			continue;
+
+		if (!best || p->receivedBlocks > best->receivedBlocks)
+			best = p;
+	}
+
+	return best ? best->index : None;
+}
+
+size_t BlockTable::freeBlocks() const
+{
+	size_t count = 0;
+	for (const auto &it : m_pieces)
+		count += it.second->freeBlocks;
+	return count;
+}
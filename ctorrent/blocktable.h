@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __BLOCKTABLE_H
+#define __BLOCKTABLE_H
+
+#include <util/bitset.h>
+#include <util/databuffer.h>
+#include <util/sha1.h>
+
+#include <unordered_map>
+#include <functional>
+#include <vector>
+#include <limits>
+#include <cstdint>
+
+// Pieces in progress, shared by every peer of a torrent.  Any peer that has
+// a piece can fill any of its free blocks, so a slow peer no longer holds
+// a whole piece hostage.  Blocks are copied straight to where they belong
+// in data, and hashed as soon as every block before them is in.
+//
+// Entries stay around until the piece is complete, so whatever a peer
+// leaves behind is picked up again by the next one.
+class BlockTable {
+public:
+	enum {
+		MaxCopies = 2		// peers a block is requested from in end-game
+	};
+
+	enum BlockState : uint8_t {
+		BS_Free,
+		BS_Requested,
+		BS_Received
+	};
+
+	struct Block {
+		uint8_t state;
+		uint8_t requests;	// outstanding requests for it
+		bool receiving;		// a peer is reading it into data right now
+		uint32_t peer;		// last requested from, or received from
+	};
+
+	struct Piece {
+		size_t index;
+		size_t freeBlocks;
+		size_t receivedBlocks;
+		size_t hashedBlocks;
+
+		std::vector<Block> blocks;
+		DataBuffer<uint8_t> data;
+		Sha1 sha1;
+
+		Piece(size_t index, size_t size);
+
+		size_t blockSize(size_t block) const;
+		bool validBlock(size_t begin, size_t size) const;
+		bool complete() const { return receivedBlocks == blocks.size(); }
+
+		void request(size_t block, uint32_t from);
+		void unrequest(size_t block);
+
+		// Where a block that is about to come off the wire goes, null if
+		// it's bad, already in or someone else is reading it.  Every
+		// claim ends with receive() or unclaim().
+		uint8_t *claim(size_t begin, size_t size);
+		void unclaim(size_t begin);
+
+		// False if that block was already in or is being read in place
+		// by someone else.  Blocks read in place (block points into
+		// data) aren't copied.
+		bool receive(size_t begin, const uint8_t *block, size_t size, uint32_t from);
+	};
+
+	static const size_t None = std::numeric_limits<size_t>::max();
+
+	~BlockTable();
+
+	Piece *find(size_t index) const;
+	Piece *add(size_t index, size_t size);
+	void remove(size_t index);
+	void clear();
+
+	// Partial piece with free blocks that the peer has and isn't already
+	// downloading, the one closest to completion first.  None if there
+	// isn't any.
+	size_t partial(const bitset &peer, const std::function<bool (size_t)> &downloading) const;
+
+	// Blocks of the pieces in progress nobody has requested yet
+	size_t freeBlocks() const;
+
+private:
+	std::unordered_map<size_t, Piece *> m_pieces;
+};
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "choker.h"
+
+#include <algorithm>
+
+static const double CapacityDecay = 0.98;	// per round
+static const double Headroom = 0.9;		// below this much of capacity we're not saturating
+static const double Growth = 1.1;		// what counts as the rate going up
+
+Choker::Choker()
+	: m_fixedSlots(0),
+	  m_autoSlots(MinSlots + 2),
+	  m_capacity(0),
+	  m_lastRate(0),
+	  m_grew(false),
+	  m_round(0),
+	  m_optimistic(0),
+	  m_random(std::random_device()())
+{
+}
+
+void Choker::resize(double uploadRate, size_t interested)
+{
+	m_capacity = std::max(uploadRate, m_capacity * CapacityDecay);
+
+	bool rising = uploadRate > m_lastRate * Growth;
+	if (m_grew && !rising && m_autoSlots > MinSlots) {
+		--m_autoSlots;
+		m_grew = false;
+	} else if ((rising || uploadRate < m_capacity * Headroom) &&
+		   m_autoSlots < interested && m_autoSlots < MaxSlots) {
+		++m_autoSlots;
+		m_grew = true;
+	} else
+		m_grew = false;
+
+	m_lastRate = uploadRate;
+}
+
+std::vector<uint32_t> Choker::run(std::vector<Candidate> &candidates, double uploadRate)
+{
+	if (!m_fixedSlots)
+		resize(uploadRate, candidates.size());
+
+	size_t slots = this->slots();
+	size_t regular = slots > 1 ? slots - 1 : slots;
+	std::sort(candidates.begin(), candidates.end(),
+		  [] (const Candidate &lhs, const Candidate &rhs) { return lhs.rate > rhs.rate; });
+
+	std::vector<uint32_t> unchoke;
+	for (size_t i = 0; i < candidates.size() && i < regular; ++i)
+		unchoke.push_back(candidates[i].ip);
+	if (slots == regular || candidates.size() <= regular) {
+		m_optimistic = 0;
+		return unchoke;
+	}
+
+	// Keep the optimistic unchoke for its rounds unless it made it to a
+	// regular slot or went away.
+	auto it = std::find_if(candidates.begin() + regular, candidates.end(),
+			       [this] (const Candidate &c) { return c.ip == m_optimistic; });
+	if (m_round++ % OptimisticRounds == 0 || it == candidates.end()) {
+		size_t pick = std::uniform_int_distribution<size_t>(regular, candidates.size() - 1)(m_random);
+		m_optimistic = candidates[pick].ip;
+	}
+
+	unchoke.push_back(m_optimistic);
+	return unchoke;
+}
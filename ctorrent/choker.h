@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __CHOKER_H
+#define __CHOKER_H
+
+#include <vector>
+#include <random>
+#include <cstdint>
+
+// Tit-for-tat: every round the interested peers that treat us best (give us
+// the best download rate, or take the best upload rate once we seed) get the
+// regular upload slots, and one more slot goes to a peer picked at random
+// (optimistic unchoke), which is rotated every OptimisticRounds rounds.
+//
+// With no fixed number of slots they are sized to the upload capacity: one
+// more as long as our upload keeps growing or stays clearly below the best
+// we've seen, one less when the last one added bought nothing.
+//
+// Not thread safe, the owner locks.
+class Choker {
+public:
+	enum {
+		Interval = 10,		// seconds between rounds
+		OptimisticRounds = 3,
+		MinSlots = 2,
+		MaxSlots = 50
+	};
+
+	struct Candidate {
+		uint32_t ip;
+		double rate;		// what the peer is ranked by
+	};
+
+	Choker();
+
+	// 0 sizes them automatically
+	void setSlots(size_t slots) { m_fixedSlots = slots; }
+	size_t slots() const { return m_fixedSlots ? m_fixedSlots : m_autoSlots; }
+
+	// A round over the interested peers, uploadRate is ours in bytes per
+	// second.  Returns the peers to unchoke, everyone else gets choked.
+	std::vector<uint32_t> run(std::vector<Candidate> &candidates, double uploadRate);
+
+protected:
+	void resize(double uploadRate, size_t interested);
+
+private:
+	size_t m_fixedSlots;
+	size_t m_autoSlots;
+	double m_capacity;		// best upload rate seen, slowly forgotten
+	double m_lastRate;
+	bool m_grew;			// last round added a slot
+
+	size_t m_round;
+	uint32_t m_optimistic;		// 0 if none
+	std::mt19937 m_random;
+};
+
+#endif
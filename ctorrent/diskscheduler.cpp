@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "diskscheduler.h"
+
+#include <util/iouring.h>
+
+#include <algorithm>
+#include <functional>
+
+DiskScheduler g_diskScheduler;
+
+DiskScheduler::DiskScheduler()
+	: m_next(0),
+	  m_sleeping(0),
+	  m_stopped(false),
+	  m_useRing(false)
+{
+}
+
+DiskScheduler::~DiskScheduler()
+{
+	stop();
+	for (Queue *q : m_queues)
+		delete q;
+}
+
+void DiskScheduler::setWorkers(size_t workers)
+{
+	if (workers == 0)
+		workers = 1;
+
+	stop();
+	m_stopped = false;
+	for (size_t i = 0; i < workers; ++i)
+		m_threads.push_back(std::thread(std::bind(&DiskScheduler::worker, this)));
+}
+
+void DiskScheduler::stop()
+{
+	m_mutex.lock();
+	m_stopped = true;
+	m_mutex.unlock();
+	m_condition.notify_all();
+
+	for (std::thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+}
+
+DiskScheduler::Queue *DiskScheduler::attach(DiskClient *client)
+{
+	if (m_threads.empty())
+		setWorkers(1);
+
+	Queue *q = new Queue();
+	q->client = client;
+	q->head = 0;
+	q->refs = 0;
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_queues.push_back(q);
+	return q;
+}
+
+void DiskScheduler::detach(Queue *q)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto it = std::find(m_queues.begin(), m_queues.end(), q);
+	if (it == m_queues.end())
+		return;
+
+	// Whatever is still queued is dropped, but wait for batches that are
+	// already at the disk.
+	collect(q);
+	q->reads.clear();
+	q->writes.clear();
+	while (q->refs != 0)
+		m_idle.wait(lock);
+
+	m_queues.erase(std::find(m_queues.begin(), m_queues.end(), q));
+	if (m_next >= m_queues.size())
+		m_next = 0;
+	delete q;
+}
+
+void DiskScheduler::pushRead(Queue *q, const ReadRequest &r)
+{
+	q->newReads.push(ReadRequest(r));
+	wakeup();
+}
+
+void DiskScheduler::pushWrite(Queue *q, WriteRequest &&w)
+{
+	q->newWrites.push(std::move(w));
+	wakeup();
+}
+
+void DiskScheduler::wakeup()
+{
+	// Pairs with the fence in worker(): either it sees our job before going
+	// to sleep or we see it asleep.  Taking the mutex makes sure it is
+	// really waiting by the time we notify.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_sleeping.load(std::memory_order_relaxed) == 0)
+		return;
+
+	m_mutex.lock();
+	m_mutex.unlock();
+	m_condition.notify_one();
+}
+
+void DiskScheduler::cancelRead(Queue *q, uint32_t from, size_t index, size_t begin, size_t size)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	collect(q);
+	for (auto it = q->reads.begin(); it != q->reads.end(); ++it) {
+		if (it->from == from && it->index == index && it->begin == begin && it->size == size) {
+			q->reads.erase(it);
+			break;
+		}
+	}
+}
+
+void DiskScheduler::cancelReads(Queue *q, uint32_t from)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	collect(q);
+	for (auto it = q->reads.begin(); it != q->reads.end();) {
+		if (it->from == from)
+			it = q->reads.erase(it);
+		else
+			++it;
+	}
+}
+
+// Sort in whatever was submitted since we last looked, m_mutex held.
+void DiskScheduler::collect(Queue *q)
+{
+	ReadRequest r;
+	while (q->newReads.pop(r))
+		q->reads.insert(r);
+
+	WriteRequest w;
+	while (q->newWrites.pop(w))
+		q->writes.push_back(std::move(w));
+}
+
+bool DiskScheduler::inboxEmpty() const
+{
+	for (const Queue *q : m_queues)
+		if (!q->newReads.empty() || !q->newWrites.empty())
+			return false;
+
+	return true;
+}
+
+DiskScheduler::Queue *DiskScheduler::nextQueue()
+{
+	for (size_t i = 0; i < m_queues.size(); ++i) {
+		size_t index = (m_next + i) % m_queues.size();
+		Queue *q = m_queues[index];
+		collect(q);
+		if (!q->reads.empty() || !q->writes.empty()) {
+			m_next = index + 1;
+			return q;
+		}
+	}
+
+	return nullptr;
+}
+
+void DiskScheduler::flushClients(std::unique_lock<std::mutex> &lock)
+{
+	// Other idle workers wake up around the same time, one is enough.
+	auto now = std::chrono::steady_clock::now();
+	if (now - m_lastFlush < std::chrono::seconds(IdleInterval))
+		return;
+
+	m_lastFlush = now;
+	std::vector<Queue *> queues = m_queues;
+	for (Queue *q : queues)
+		++q->refs;
+	lock.unlock();
+
+	for (Queue *q : queues)
+		q->client->flush();
+
+	lock.lock();
+	for (Queue *q : queues)
+		--q->refs;
+	m_idle.notify_all();
+}
+
+void DiskScheduler::worker()
+{
+	IoUring ring;
+	bool ringTried = false;
+
+	std::vector<WriteRequest> writes;
+	std::vector<ReadRequest> reads;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	writes.reserve(MaxBatchJobs);
+	reads.reserve(MaxBatchJobs);
+	while (!m_stopped) {
+		Queue *q = nextQueue();
+		if (!q) {
+			m_sleeping.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!inboxEmpty()) {
+				// Submitted after nextQueue() looked, or still being linked in
+				m_sleeping.fetch_sub(1);
+				continue;
+			}
+
+			bool timeout = m_condition.wait_for(lock, std::chrono::seconds(IdleInterval)) == std::cv_status::timeout;
+			m_sleeping.fetch_sub(1);
+			if (timeout)
+				flushClients(lock);
+			continue;
+		}
+
+		size_t bytes = 0;
+		while (!q->writes.empty() && writes.size() < MaxBatchJobs && bytes < MaxBatchBytes) {
+			bytes += q->writes.front().data.size();
+			writes.push_back(std::move(q->writes.front()));
+			q->writes.pop_front();
+		}
+
+		// Sweep upwards from where the head was left, wrap around once we
+		// run off the end.
+		auto it = q->reads.lower_bound(ReadRequest { 0, 0, 0, 0, q->head });
+		while (!q->reads.empty() && writes.size() + reads.size() < MaxBatchJobs && bytes < MaxBatchBytes) {
+			if (it == q->reads.end()) {
+				if (!reads.empty())
+					break;	// keep the batch sorted, next one starts over
+				it = q->reads.begin();
+			}
+
+			bytes += it->size;
+			reads.push_back(*it);
+			it = q->reads.erase(it);
+		}
+
+		if (!reads.empty())
+			q->head = reads.back().offset + reads.back().size;
+
+		++q->refs;
+		lock.unlock();
+
+		if (m_useRing && !ringTried) {
+			ring.init(MaxBatchJobs);
+			ringTried = true;
+		}
+
+		q->client->processBatch(writes, reads, ring.valid() ? &ring : nullptr);
+		writes.clear();
+		reads.clear();
+
+		lock.lock();
+		if (--q->refs == 0)
+			m_idle.notify_all();
+	}
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __DISKSCHEDULER_H
+#define __DISKSCHEDULER_H
+
+#include <util/databuffer.h>
+#include <util/mpscqueue.h>
+
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class IoUring;
+
+struct ReadRequest {
+	size_t index;
+	uint32_t from;
+	size_t begin;
+	size_t size;
+	size_t offset;		// absolute position in the torrent, what the elevator sorts on
+};
+
+struct WriteRequest {
+	size_t index;
+	uint32_t from;
+	DataBuffer<uint8_t> data;
+};
+
+// Implemented by whoever owns the files (TorrentFileManager), called from one
+// of the scheduler's worker threads with a batch of jobs.  Reads are handed
+// over in ascending offset order.  flush() is called every IdleInterval
+// seconds while there is nothing else to do.
+class DiskClient {
+public:
+	virtual ~DiskClient() { }
+	virtual void processBatch(std::vector<WriteRequest> &writes, std::vector<ReadRequest> &reads, IoUring *ring) = 0;
+	virtual void flush() { }
+};
+
+// One set of disk workers shared by every torrent in the session.  Pending
+// reads are served in C-SCAN (elevator) order per torrent, and torrents take
+// turns in round robin one batch at a time.
+//
+// Submitting doesn't lock: jobs go to the queue's inbox and are sorted in by
+// the next worker that looks for work, which takes all of them at once.
+// Workers are only woken when some of them are asleep.
+class DiskScheduler {
+	enum {
+		MaxBatchJobs = 64,
+		MaxBatchBytes = 4 << 20,
+		IdleInterval = 2	// seconds
+	};
+
+	struct ElevatorOrder {
+		bool operator() (const ReadRequest &lhs, const ReadRequest &rhs) const {
+			return lhs.offset < rhs.offset;
+		}
+	};
+
+public:
+	struct Queue {
+		DiskClient *client;
+		MPSCQueue<ReadRequest> newReads;
+		MPSCQueue<WriteRequest> newWrites;
+
+		// The rest is covered by the scheduler's mutex
+		std::multiset<ReadRequest, ElevatorOrder> reads;
+		std::deque<WriteRequest> writes;
+		size_t head;		// elevator position
+		size_t refs;		// workers busy with a batch of ours
+	};
+
+	DiskScheduler();
+	~DiskScheduler();
+
+	void setWorkers(size_t workers);
+	void enableRing() { m_useRing = true; }
+
+	// The queue stays valid until detach(), jobs are pushed straight to it
+	Queue *attach(DiskClient *client);
+	void detach(Queue *q);
+
+	void pushRead(Queue *q, const ReadRequest &r);
+	void pushWrite(Queue *q, WriteRequest &&w);
+
+	// Drop queued reads that haven't made it to the disk yet
+	void cancelRead(Queue *q, uint32_t from, size_t index, size_t begin, size_t size);
+	void cancelReads(Queue *q, uint32_t from);
+
+protected:
+	void worker();
+	void stop();
+	void wakeup();
+	void collect(Queue *q);
+	bool inboxEmpty() const;
+	Queue *nextQueue();
+	void flushClients(std::unique_lock<std::mutex> &lock);
+
+private:
+	std::vector<Queue *> m_queues;
+	size_t m_next;
+	std::chrono::steady_clock::time_point m_lastFlush;
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::condition_variable m_idle;
+	std::atomic<size_t> m_sleeping;	// workers waiting on m_condition
+	bool m_stopped;
+	bool m_useRing;
+};
+
+extern DiskScheduler g_diskScheduler;
+
+#endif
@@ -22,44 +22,108 @@
 #include "peer.h"
 #include "torrent.h"
 
+// Everything that comes in from the connection runs under the torrent's
+// lock, whatever network thread it's on.
+#define LOCK_TORRENT()	std::lock_guard<std::recursive_mutex> guard(m_torrent->m_mutex)
+
 #define KEEPALIVE_INTERVAL	30 * 1000
+#define INPUT_BUFFER_SIZE	32768
+
+// Biggest legit message is a block or a full bitfield
+static size_t maxMessageSize(Torrent *torrent)
+{
+	return std::max<size_t>(9 + maxRequestSize, 1 + (torrent->fileManager()->totalPieces() + 7) / 8);
+}
+
+// Has to hold the biggest message with its length, as a power of two
+static size_t inputBufferSize(size_t maxMessage)
+{
+	size_t size = INPUT_BUFFER_SIZE;
+	while (size < 4 + maxMessage)
+		size <<= 1;
+	return size;
+}
 
 Peer::Peer(Torrent *torrent)
 	: m_bitset(torrent->fileManager()->totalPieces()),
+	  m_input(inputBufferSize(maxMessageSize(torrent))),
+	  m_maxMessage(maxMessageSize(torrent)),
+	  m_downloadMeter(torrent->downloadMeter()),
+	  m_uploadMeter(torrent->uploadMeter()),
+	  m_uploadLimiter(std::make_shared<RateLimiter>(torrent->uploadLimiter())),
+	  m_downloadLimiter(std::make_shared<RateLimiter>(torrent->downloadLimiter())),
 	  m_torrent(torrent),
 	  m_conn(new Connection())
 {
 	m_state = PS_AmChoked | PS_PeerChoked;
+	m_minRtt = Clock::duration::max();
+	m_receiving = false;
 }
 
 Peer::Peer(const ConnectionPtr &c, Torrent *t)
 	: m_bitset(t->fileManager()->totalPieces()),
+	  m_input(inputBufferSize(maxMessageSize(t))),
+	  m_maxMessage(maxMessageSize(t)),
+	  m_downloadMeter(t->downloadMeter()),
+	  m_uploadMeter(t->uploadMeter()),
+	  m_uploadLimiter(std::make_shared<RateLimiter>(t->uploadLimiter())),
+	  m_downloadLimiter(std::make_shared<RateLimiter>(t->downloadLimiter())),
 	  m_torrent(t),
 	  m_conn(c)
 {
 	m_state = PS_AmChoked | PS_PeerChoked;
+	m_minRtt = Clock::duration::max();
+	m_receiving = false;
 }
 
 Peer::~Peer()
 {
-	for (Piece *p : m_queue)
-		delete p;
+}
+
+void Peer::releasePieces()
+{
+	resetRequests();
+	for (const Download &d : m_queue)
+		m_torrent->fileManager()->releasePiece(d.index);
 	m_queue.clear();
 }
 
 void Peer::disconnect()
 {
-	m_conn->close(false);
-	m_conn->setErrorCallback(nullptr);	// deref
+	m_state |= PS_Disconnected;
+
+	// A block being read in place may still be coming in on the
+	// connection's thread, it's only free for others once the socket is
+	// closed there.
+	PeerPtr self = shared_from_this();
+	m_conn->close(false, [self, this] () {
+		LOCK_TORRENT();
+		if (!m_receiving)
+			return;
+
+		BlockTable::Piece *piece = m_torrent->blocks()->find(m_receivingIndex);
+		if (piece)
+			piece->unclaim(m_receivingBegin);
+		m_receiving = false;
+	});
 }
 
 void Peer::connect(const std::string &ip, const std::string &port)
 {
 	m_conn->setErrorCallback(std::bind(&Peer::handleError, shared_from_this(), std::placeholders::_1));
 	m_conn->connect(ip, port, [this] () {
+		LOCK_TORRENT();
+		if (isDisconnected())
+			return;
+
+		attachLimiters();
 		const uint8_t *m_handshake = m_torrent->handshake();
 		m_conn->write(m_handshake, 68);
 		m_conn->read(68, [this, m_handshake] (const uint8_t *handshake, size_t size) {
+			LOCK_TORRENT();
+			if (isDisconnected())
+				return;
+
 			if (size != 68 ||
 			    (handshake[0] != 0x13 && memcmp(&handshake[1], "BitTorrent protocol", 19) != 0) ||
 			    memcmp(&handshake[28], &m_handshake[28], 20) != 0)
@@ -72,7 +136,7 @@ void Peer::connect(const std::string &ip, const std::string &port)
 			m_peerId = peerId;
 			m_torrent->addPeer(shared_from_this());
 			m_torrent->sendBitfield(shared_from_this());
-			m_conn->read(4, std::bind(&Peer::handle, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+			readMore();
 		});
 	});
 }
@@ -81,7 +145,12 @@ void Peer::verify()
 {
 	const uint8_t *m_handshake = m_torrent->handshake();
 	m_conn->setErrorCallback(std::bind(&Peer::handleError, shared_from_this(), std::placeholders::_1));
+	attachLimiters();
 	m_conn->read(68, [this, m_handshake] (const uint8_t *handshake, size_t size) {
+		LOCK_TORRENT();
+		if (isDisconnected())
+			return;
+
 		if (size != 68 ||
 		    (handshake[0] != 0x13 && memcmp(&handshake[1], "BitTorrent protocol", 19) != 0) ||
 		    memcmp(&handshake[28], &m_handshake[28], 20) != 0)
@@ -94,25 +163,104 @@ void Peer::verify()
 		m_peerId = peerId;
 		m_conn->write(m_handshake, 68);
 		m_torrent->handleNewPeer(shared_from_this());
-		m_conn->read(4, std::bind(&Peer::handle, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+		readMore();
 	});
 }
 
-void Peer::handle(const uint8_t *data, size_t size)
+void Peer::attachLimiters()
 {
-	if (size != 4)
-		return handleError("Peer::handle(): Expected 4-byte length");
+	if (m_torrent->limitLocal() || !isLocalAddress(ip()))
+		m_conn->setLimiters(m_uploadLimiter, m_downloadLimiter);
+}
 
-	uint32_t length = readBE32(data);
-	switch (length) {
-	case 0: // Keep alive
-		return m_conn->read(4, std::bind(&Peer::handle, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
-	default:
-		m_conn->read(length, [this] (const uint8_t *data, size_t size) {
-			InputMessage in(const_cast<uint8_t *>(&data[1]), size - 1, ByteOrder::BigEndian);
-			handleMessage((MessageType)data[0], in);
-		});
+void Peer::readMore()
+{
+	size_t len;
+	uint8_t *buffer = m_input.reserve(len);
+	m_conn->read_partial(buffer, len, std::bind(&Peer::handleData, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+}
+
+void Peer::handleData(const uint8_t *data, size_t size)
+{
+	LOCK_TORRENT();
+	if (isDisconnected())
+		return;
+
+	m_input.commit(size);
+	if (parse())
+		readMore();
+}
+
+// Handles every complete message in m_input.  A piece block that isn't all
+// in yet is read straight into its slot in the piece instead, false if
+// that (or an error) took over the connection.
+bool Peer::parse()
+{
+	while (m_input.size() >= 4) {
+		uint8_t header[13];
+		m_input.peek(0, header, 4);
+
+		uint32_t length = readBE32(header);
+		if (length == 0) {	// Keep alive
+			m_input.consume(4);
+			continue;
+		}
+
+		if (length > m_maxMessage) {
+			handleError("message of " + bytesToHumanReadable(length, true) + " is too big");
+			return false;
+		}
+
+		if (m_input.size() < 4 + length) {
+			if (m_input.size() < 13 || length <= 9)
+				break;
+
+			m_input.peek(4, &header[4], 9);
+			if (header[4] == MT_PieceBlock && receiveInPlace(readBE32(&header[5]), readBE32(&header[9]), length - 9))
+				return false;
+			break;
+		}
+
+		uint8_t *msg = m_input.front(4 + length);
+		InputMessage in(&msg[5], length - 1, ByteOrder::BigEndian);
+		handleMessage((MessageType)msg[4], in);
+		m_input.consume(4 + length);
+
+		if (!m_conn->isConnected())
+			return false;
 	}
+
+	return true;
+}
+
+// What of the block is in m_input already is copied over, the rest is read
+// from the socket right into the piece.
+bool Peer::receiveInPlace(uint32_t index, uint32_t begin, size_t blockSize)
+{
+	BlockTable::Piece *piece = m_torrent->blocks()->find(index);
+	uint8_t *slot = piece ? piece->claim(begin, blockSize) : nullptr;
+	if (!slot)
+		return false;	// bad, redundant or on its way from someone else
+
+	size_t have = m_input.size() - 13;
+	m_input.peek(13, slot, have);
+	m_input.consume(13 + have);
+
+	m_receiving = true;
+	m_receivingIndex = index;
+	m_receivingBegin = begin;
+	PeerPtr self = shared_from_this();
+	m_conn->read(slot + have, blockSize - have, [self, this, index, begin, slot, blockSize] (const uint8_t *, size_t) {
+		LOCK_TORRENT();
+		if (isDisconnected())
+			return;
+
+		m_receiving = false;
+		handlePieceBlock(index, begin, slot, blockSize);
+		if (m_conn->isConnected())
+			readMore();
+	});
+	return true;
 }
 
 void Peer::handleMessage(MessageType messageType, InputMessage in)
@@ -125,14 +273,14 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 			return handleError("invalid choke-message size");
 
 		m_state |= PS_PeerChoked;
+		resetRequests();
 		break;
 	case MT_UnChoke:
 		if (payloadSize != 0)
 			return handleError("invalid unchoke-message size");
 
-		m_state &= ~PS_PeerChoked;		
-		for (const Piece *piece : m_queue)
-			requestPiece(piece->index);
+		m_state &= ~PS_PeerChoked;
+		requestBlocks();
 		break;
 	case MT_Interested:
 	{
@@ -140,8 +288,7 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 			return handleError("invalid interested-message size");
 
 		m_state |= PS_PeerInterested;
-		if (isLocalChoked())
-			sendUnchoke();
+		m_torrent->handleInterested(shared_from_this());
 		break;
 	}
 	case MT_NotInterested:
@@ -156,8 +303,12 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 			return handleError("invalid have-message size");
 
 		uint32_t i = in.getU32();
-		if (i < m_bitset.size())
+		if (i < m_bitset.size() && !m_bitset.test(i)) {
 			m_bitset.set(i);
+			m_torrent->fileManager()->addAvailability(i);
+			if (m_outstanding.size() < requestQueueSize())
+				requestBlocks();
+		}
 		break;
 	}
 	case MT_Bitfield:
@@ -170,14 +321,15 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 			for (size_t x = 0; x < 8; ++x) {
 				if (buf[i] & (1 << (7 - x))) {
 					size_t idx = i * 8 + x;
-					if (idx < m_torrent->fileManager()->totalPieces())
+					if (idx < m_torrent->fileManager()->totalPieces() && !m_bitset.test(idx)) {
 						m_bitset.set(idx);
+						m_torrent->fileManager()->addAvailability(idx);
+					}
 				}
 			}
 		}
 
-		if (!m_torrent->isFinished())
-			m_torrent->requestPiece(shared_from_this());
+		requestBlocks();
 		break;
 	}
 	case MT_Request:
@@ -188,24 +340,24 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 		if (!isRemoteInterested())
 			return handleError("peer requested piece block without showing interest");
 
-		if (isLocalChoked())
-			return handleError("peer requested piece while choked");
-
 		uint32_t index, begin, length;
 		in >> index;
 		in >> begin;
 		in >> length;
 
+		// May have crossed our choke on the wire
+		if (isLocalChoked())
+			break;
+
 		if (length > maxRequestSize)
 			return handleError("peer requested block of length " + bytesToHumanReadable(length, true) + " which is beyond our max request size");
 
 		m_torrent->handlePeerDebug(shared_from_this(), "requested piece block of length " + bytesToHumanReadable(length, true));
+		m_requestedBlocks.push_back(PieceBlockInfo(index, begin, length));
 		if (!m_torrent->handleRequestBlock(shared_from_this(), index, begin, length)) {
+			m_requestedBlocks.pop_back();
 			sendChoke();
-			break;
 		}
-
-		m_requestedBlocks.push_back(PieceBlockInfo(index, begin, length));
 		break;
 	}
 	case MT_PieceBlock:
@@ -217,48 +369,7 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 		in >> index;
 		in >> begin;
 
-		payloadSize -= 8;	// deduct index and begin
-		if (payloadSize == 0 || payloadSize > maxRequestSize)
-			return handleError("received too big piece block of size " + bytesToHumanReadable(payloadSize, true));
-
-		auto it = std::find_if(m_queue.begin(), m_queue.end(),
-				       [index](const Piece *piece) { return piece->index == index; });
-		if (it == m_queue.end())
-			return handleError("received piece " + std::to_string(index) + " which we did not ask for");
-
-		Piece *piece = *it;
-		uint32_t blockIndex = begin / maxRequestSize;
-		if (blockIndex >= piece->numBlocks)
-			return handleError("received too big block index");
-
-		if (m_torrent->fileManager()->pieceDone(index)) {
-			cancelPiece(piece);
-			m_queue.erase(it);
-			delete piece;
-		} else {
-			uint8_t *payload = in.getBuffer(payloadSize);
-			PieceBlock *block = &piece->blocks[blockIndex];
-			block->size = payloadSize;
-			block->data = payload;
-			++piece->currentBlocks;
-
-			if (piece->currentBlocks == piece->numBlocks) {
-				DataBuffer<uint8_t> pieceData;
-				pieceData.reserve(piece->numBlocks * maxRequestSize);	// just a prediction could be bit less
-				for (size_t x = 0; x < piece->numBlocks; ++x)
-					for (size_t y = 0; y < piece->blocks[x].size; ++y)
-						pieceData.add_unchecked(piece->blocks[x].data[y]);
-
-				m_queue.erase(it);
-				delete piece;
-
-				if (!m_torrent->handlePieceCompleted(shared_from_this(), index, std::move(pieceData)))
-					sendChoke();
-				else if (!m_torrent->isFinished())
-					m_torrent->requestPiece(shared_from_this());
-			}
-		}
-
+		handlePieceBlock(index, begin, in.getBuffer(), payloadSize - 8);
 		break;
 	}
 	case MT_Cancel:
@@ -275,8 +386,10 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 				[=] (const PieceBlockInfo &i) { return i.index == index
 									&& i.begin == begin
 									&& i.length == length; } );
-		if (it != m_requestedBlocks.end())
+		if (it != m_requestedBlocks.end()) {
 			m_requestedBlocks.erase(it);
+			m_torrent->fileManager()->cancelPieceBlock(index, ip(), begin, length);
+		}
 		break;
 	}
 	case MT_Port:
@@ -287,12 +400,61 @@ void Peer::handleMessage(MessageType messageType, InputMessage in)
 		in >> port;
 		break;
 	}
+}
+
+void Peer::handlePieceBlock(uint32_t index, uint32_t begin, const uint8_t *block, size_t size)
+{
+	if (size == 0 || size > maxRequestSize)
+		return handleError("received too big piece block of size " + bytesToHumanReadable(size, true));
+
+	Clock::time_point now = Clock::now();
+	m_downloadMeter.add(size);
+
+	bool requested = false;
+	auto req = std::find_if(m_outstanding.begin(), m_outstanding.end(),
+				[index, begin](const BlockRequest &r) { return r.index == index && r.begin == begin; });
+	if (req != m_outstanding.end()) {
+		m_minRtt = std::min(m_minRtt, now - req->sentAt);
+		m_outstanding.erase(req);
+		requested = true;
+	}
 
-	m_conn->read(4, std::bind(&Peer::handle, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+	BlockTable::Piece *piece = m_torrent->blocks()->find(index);
+	if (!piece) {
+		// Most likely a block we cancelled (end-game) that was already
+		// on its way.
+		TorrentFileManager *fm = m_torrent->fileManager();
+		if (requested || fm->pieceDone(index) || fm->piecePending(index)) {
+			m_torrent->handleRedundantBlock(shared_from_this(), size);
+			return requestBlocks();
+		}
+
+		return handleError("received piece " + std::to_string(index) + " which we did not ask for");
+	}
+
+	if (!piece->validBlock(begin, size))
+		return handleError("received piece block with bad offset or size");
+
+	const BlockTable::Block &b = piece->blocks[begin / maxRequestSize];
+	bool others = b.state == BlockTable::BS_Requested && b.requests > (requested ? 1 : 0);
+	if (!piece->receive(begin, block, size, ip())) {
+		m_torrent->handleRedundantBlock(shared_from_this(), size);
+	} else {
+		if (others)
+			m_torrent->cancelBlock(shared_from_this(), index, begin);
+		if (piece->complete())
+			m_torrent->handlePieceCompleted(shared_from_this(), index);
+	}
+
+	requestBlocks();
 }
 
 void Peer::handleError(const std::string &errmsg)
 {
+	LOCK_TORRENT();
+	if (isDisconnected())
+		return;
+
 	m_torrent->removePeer(shared_from_this(), errmsg);
 	disconnect();
 }
@@ -310,6 +472,29 @@ void Peer::handlePieceBlockData(size_t index, size_t begin, const uint8_t *block
 		sendPieceBlock(index, begin, block, size);
 }
 
+bool Peer::handlePieceBlockFile(size_t index, size_t begin, int fd, uint64_t offset, size_t size)
+{
+	auto it = std::find_if(m_requestedBlocks.begin(), m_requestedBlocks.end(),
+			       [=] (const PieceBlockInfo &i) { return i.index == index && i.begin == begin; } );
+	if (it == m_requestedBlocks.end())
+		return false;
+
+	m_requestedBlocks.erase(it);
+	if (isLocalChoked() || !isRemoteInterested())
+		return false;
+
+	OutputMessage out(ByteOrder::BigEndian, 13);
+	out << (uint32_t)(9UL + size);	// length
+	out << (uint8_t)MT_PieceBlock;
+	out << (uint32_t)index;
+	out << (uint32_t)begin;
+
+	m_conn->write(std::move(out));
+	m_conn->writeFile(fd, offset, size);
+	m_uploadMeter.add(size);
+	return true;
+}
+
 void Peer::sendKeepAlive()
 {
 	const uint8_t keepalive[] = { 0, 0, 0, 0 };
@@ -321,6 +506,10 @@ void Peer::sendChoke()
 	const uint8_t choke[5] = { 0, 0, 0, 1, MT_Choke };
 	m_conn->write(choke, sizeof(choke));
 	m_state |= PS_AmChoked;
+
+	// Choking drops whatever the peer asked for so far
+	m_requestedBlocks.clear();
+	m_torrent->fileManager()->cancelRequests(ip());
 }
 
 void Peer::sendUnchoke()
@@ -337,20 +526,17 @@ void Peer::sendBitfield(const uint8_t *bits, size_t size)
 	out << (uint8_t)MT_Bitfield;
 	out.addBytes(bits, size);
 
-	m_conn->write(out);
+	m_conn->write(std::move(out));
 }
 
 void Peer::sendHave(uint32_t index)
 {
-	if (isLocalChoked())
-		return;
-
 	OutputMessage out(ByteOrder::BigEndian, 9);
 	out << (uint32_t)5UL;		// length
 	out << (uint8_t)MT_Have;
 	out << index;
 
-	m_conn->write(out);
+	m_conn->write(std::move(out));
 }
 
 void Peer::sendPieceBlock(uint32_t index, uint32_t begin, const uint8_t *block, size_t length)
@@ -362,25 +548,21 @@ void Peer::sendPieceBlock(uint32_t index, uint32_t begin, const uint8_t *block,
 	out << begin;
 	out.addBytes(block, length);
 
-	m_conn->write(out);
+	m_conn->write(std::move(out));
+	m_uploadMeter.add(length);
 }
 
-void Peer::sendPieceRequest(uint32_t index)
+void Peer::sendPieceBlock(uint32_t index, uint32_t begin, const SharedBuffer &buffer, size_t offset, size_t length)
 {
-	sendInterested();
-
-	uint32_t pieceLength = m_torrent->fileManager()->pieceSize(index);
-	size_t numBlocks = (int)(ceil(double(pieceLength) / maxRequestSize));
-
-	Piece *piece = new Piece();
-	piece->index = index;
-	piece->currentBlocks = 0;
-	piece->numBlocks = numBlocks;
-	piece->blocks = new PieceBlock[numBlocks];
+	OutputMessage out(ByteOrder::BigEndian, 13);
+	out << (uint32_t)(9UL + length);	// length
+	out << (uint8_t)MT_PieceBlock;
+	out << index;
+	out << begin;
 
-	m_queue.push_back(piece);
-	if (!isRemoteChoked())
-		requestPiece(index);
+	m_conn->write(std::move(out));
+	m_conn->write(buffer, offset, length);
+	m_uploadMeter.add(length);
 }
 
 void Peer::sendRequest(uint32_t index, uint32_t begin, uint32_t length)
@@ -392,7 +574,7 @@ void Peer::sendRequest(uint32_t index, uint32_t begin, uint32_t length)
 	out << begin;
 	out << length;
 
-	m_conn->write(out);
+	m_conn->write(std::move(out));
 }
 
 void Peer::sendInterested()
@@ -403,13 +585,84 @@ void Peer::sendInterested()
 	m_state |= PS_AmInterested;
 }
 
-void Peer::cancelPiece(Piece *p)
+// Cancels whatever we still wait for in index, the blocks are free for
+// other peers to take.
+void Peer::cancelRequests(size_t index)
+{
+	BlockTable::Piece *piece = m_torrent->blocks()->find(index);
+	size_t pieceLength = m_torrent->fileManager()->pieceSize(index);
+
+	auto it = m_outstanding.begin();
+	while (it != m_outstanding.end()) {
+		if (it->index != index) {
+			++it;
+			continue;
+		}
+
+		sendCancel(it->index, it->begin, std::min<size_t>(maxRequestSize, pieceLength - it->begin));
+		if (piece)
+			piece->unrequest(it->begin / maxRequestSize);
+		it = m_outstanding.erase(it);
+	}
+}
+
+void Peer::cancelBlock(size_t index, size_t begin)
+{
+	auto it = std::find_if(m_outstanding.begin(), m_outstanding.end(),
+			       [index, begin](const BlockRequest &r) { return r.index == index && r.begin == begin; });
+	if (it == m_outstanding.end())
+		return;
+
+	sendCancel(index, begin, std::min<size_t>(maxRequestSize, m_torrent->fileManager()->pieceSize(index) - begin));
+	m_outstanding.erase(it);
+}
+
+bool Peer::isDownloading(size_t index) const
+{
+	return std::find_if(m_queue.begin(), m_queue.end(),
+			    [index](const Download &d) { return d.index == index; }) != m_queue.end();
+}
+
+// They have a piece we still need
+bool Peer::hasWantedPiece() const
+{
+	const atomic_bitset *completed = m_torrent->fileManager()->completedBits();
+	for (size_t i = 0; i < completed->size(); ++i)
+		if (m_bitset.test(i) && !completed->test(i))
+			return true;
+
+	return false;
+}
+
+// We have a request for that block out already
+bool Peer::isRequested(size_t index, size_t begin) const
 {
-	size_t begin = 0;
-	size_t length = m_torrent->fileManager()->pieceSize(p->index);
-	for (; length > maxRequestSize; length -= maxRequestSize, begin += maxRequestSize)
-		sendCancel(p->index, begin, maxRequestSize);
-	sendCancel(p->index, begin, length);
+	return std::find_if(m_outstanding.begin(), m_outstanding.end(),
+			    [index, begin](const BlockRequest &r) { return r.index == index && r.begin == begin; }) != m_outstanding.end();
+}
+
+// Enough requests to keep the bandwidth-delay product in flight, with half
+// again as much headroom so the pipe never runs dry while we measure.
+size_t Peer::requestQueueSize() const
+{
+	if (m_minRtt == Clock::duration::max())
+		return MinRequests;
+
+	std::chrono::duration<double> rtt = m_minRtt;
+	size_t blocks = m_downloadMeter.rate(RateMeter::Short) * rtt.count() * 1.5 / maxRequestSize;
+	return std::min<size_t>(blocks + MinRequests, MaxRequests);
+}
+
+void Peer::dropPiece(size_t index)
+{
+	auto it = std::find_if(m_queue.begin(), m_queue.end(),
+			       [index](const Download &d) { return d.index == index; });
+	if (it == m_queue.end())
+		return;
+
+	cancelRequests(index);
+	m_queue.erase(it);
+	m_torrent->fileManager()->releasePiece(index);
 }
 
 void Peer::sendCancel(uint32_t index, uint32_t begin, uint32_t length)
@@ -421,18 +674,77 @@ void Peer::sendCancel(uint32_t index, uint32_t begin, uint32_t length)
 	out << begin;
 	out << length;
 
-	m_conn->write(out);
+	m_conn->write(std::move(out));
 }
 
-void Peer::requestPiece(size_t pieceIndex)
+void Peer::queuePiece(size_t index, bool duplicate)
 {
-	if (isRemoteChoked())
-		return handleError("Attempt to request piece from a peer that is remotely choked");
+	m_queue.push_back(Download { index, duplicate });
+}
 
-	size_t begin = 0;
-	size_t length = m_torrent->fileManager()->pieceSize(pieceIndex);
-	for (; length > maxRequestSize; length -= maxRequestSize, begin += maxRequestSize)
-		sendRequest(pieceIndex, begin, maxRequestSize);
-	sendRequest(pieceIndex, begin, length);
+// Tops the outstanding requests up to requestQueueSize(), oldest pieces
+// first, and only asks the torrent for another piece once every block we
+// can take from the ones we hold is requested.
+void Peer::requestBlocks()
+{
+	if (m_torrent->isFinished())
+		return;
+
+	if (isRemoteChoked()) {
+		// Nothing is picked before they unchoke us, whether we're
+		// interested only depends on what they have
+		if (!isLocalInterested() && hasWantedPiece())
+			sendInterested();
+		return;
+	}
+
+	size_t target = requestQueueSize();
+	size_t next = 0;
+	size_t block = 0;
+	while (m_outstanding.size() < target) {
+		BlockTable::Piece *piece = nullptr;
+		for (; next < m_queue.size(); ++next, block = 0) {
+			const Download &d = m_queue[next];
+			BlockTable::Piece *p = m_torrent->blocks()->find(d.index);
+			for (; p && block < p->blocks.size(); ++block) {
+				const BlockTable::Block &b = p->blocks[block];
+				if (b.state == BlockTable::BS_Free
+				    || (d.duplicate && b.state == BlockTable::BS_Requested
+					&& b.requests < BlockTable::MaxCopies && !isRequested(d.index, block * maxRequestSize))) {
+					piece = p;
+					break;
+				}
+			}
+
+			if (piece)
+				break;
+		}
+
+		if (!piece) {
+			if (!m_torrent->requestPiece(shared_from_this()))
+				break;
+			continue;
+		}
+
+		if (!isLocalInterested())
+			sendInterested();
+
+		size_t begin = block * maxRequestSize;
+		piece->request(block, ip());
+		m_outstanding.push_back(BlockRequest { (uint32_t)piece->index, (uint32_t)begin, Clock::now() });
+		sendRequest(piece->index, begin, piece->blockSize(block));
+		++block;
+	}
 }
 
+// A choke discards every request we had outstanding, the blocks are free
+// for other peers to take.
+void Peer::resetRequests()
+{
+	for (const BlockRequest &r : m_outstanding) {
+		BlockTable::Piece *piece = m_torrent->blocks()->find(r.index);
+		if (piece)
+			piece->unrequest(r.begin / maxRequestSize);
+	}
+	m_outstanding.clear();
+}
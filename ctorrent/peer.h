@@ -27,18 +27,22 @@
 
 #include <memory>
 #include <vector>
+#include <deque>
+#include <chrono>
 
 #include <util/bitset.h>
+#include <util/ringbuffer.h>
+#include <util/ratemeter.h>
 
 class Torrent;
 class Peer : public std::enable_shared_from_this<Peer>
 {
-	struct Piece;
 	enum State : uint8_t {
 		PS_AmChoked = 1 << 0,			// We choked this peer (aka we're not giving him anymore pieces)
 		PS_AmInterested = 1 << 1,		// We're interested in this peer's pieces
 		PS_PeerChoked = 1 << 2,			// Peer choked us
 		PS_PeerInterested = 1 << 3,		// Peer interested in our stuff
+		PS_Disconnected = 1 << 4,		// Dropped, what's still on its way is ignored
 	};
 
 	enum MessageType : uint8_t {
@@ -67,10 +71,16 @@ public:
 
 protected:
 	void verify();
-	void handle(const uint8_t *data, size_t size);
+	void attachLimiters();
+	void readMore();
+	void handleData(const uint8_t *data, size_t size);
+	bool parse();
+	bool receiveInPlace(uint32_t index, uint32_t begin, size_t blockSize);
 	void handleMessage(MessageType mType, InputMessage in);
+	void handlePieceBlock(uint32_t index, uint32_t begin, const uint8_t *block, size_t size);
 	void handleError(const std::string &errmsg);
 	void handlePieceBlockData(size_t index, size_t begin, const uint8_t *block, size_t size);
+	bool handlePieceBlockFile(size_t index, size_t begin, int fd, uint64_t offset, size_t size);
 
 	void sendKeepAlive();
 	void sendChoke();
@@ -78,37 +88,58 @@ protected:
 	void sendBitfield(const uint8_t *bits, size_t size);
 	void sendHave(uint32_t index);
 	void sendPieceBlock(uint32_t index, uint32_t begin, const uint8_t *block, size_t size);
-	void sendPieceRequest(uint32_t index);
+	// Sent straight out of buffer, which isn't copied
+	void sendPieceBlock(uint32_t index, uint32_t begin, const SharedBuffer &buffer, size_t offset, size_t size);
 	void sendRequest(uint32_t index, uint32_t begin, uint32_t size);
 	void sendInterested();
 	void sendCancel(uint32_t index, uint32_t begin, uint32_t size);
 
-	void requestPiece(size_t pieceIndex);
-	void cancelPiece(Piece *p);
+	void queuePiece(size_t index, bool duplicate);
+	void requestBlocks();
+	void resetRequests();
+	void cancelRequests(size_t index);
+	void cancelBlock(size_t index, size_t begin);
+	void dropPiece(size_t index);
+	void releasePieces();
 
 	inline bool hasPiece(size_t i) const { return m_bitset.test(i); }
+	bool isDownloading(size_t index) const;
+	bool isRequested(size_t index, size_t begin) const;
+	bool hasWantedPiece() const;
+	inline double downloadRate() const { return m_downloadMeter.rate(); }
+	const RateMeter *downloadMeter() const { return &m_downloadMeter; }
+	const RateMeter *uploadMeter() const { return &m_uploadMeter; }
+	// Bytes per second on top of the torrent's limits, 0 is unlimited
+	void setUploadLimit(size_t limit) { m_uploadLimiter->setLimit(limit); }
+	void setDownloadLimit(size_t limit) { m_downloadLimiter->setLimit(limit); }
+	size_t requestQueueSize() const;
 	inline bool isRemoteChoked() const { return test_bit(m_state, PS_PeerChoked); }
 	inline bool isLocalChoked() const  { return test_bit(m_state, PS_AmChoked); }
 
+	inline bool isDisconnected() const { return test_bit(m_state, PS_Disconnected); }
 	inline bool isRemoteInterested() const { return test_bit(m_state, PS_PeerInterested); }
 	inline bool isLocalInterested() const { return test_bit(m_state, PS_AmInterested); }
 
 private:
-	struct PieceBlock {
-		size_t size;
-		uint8_t *data;
-
-		PieceBlock() { data = nullptr; size  = 0; }
-		~PieceBlock() { delete []data; }
+	enum {
+		MinRequests = 4,
+		MaxRequests = 500
 	};
 
-	struct Piece {
+	typedef std::chrono::steady_clock Clock;
+
+	// A piece we work on, its blocks are in Torrent's BlockTable.  If it was
+	// already being downloaded when we got it (end-game, or a streaming
+	// deadline at risk), blocks others asked for may be asked for again.
+	struct Download {
 		size_t index;
-		size_t currentBlocks;
-		size_t numBlocks;
+		bool duplicate;
+	};
 
-		~Piece() { delete []blocks; }
-		PieceBlock *blocks;
+	struct BlockRequest {
+		uint32_t index;
+		uint32_t begin;
+		Clock::time_point sentAt;
 	};
 
 	struct PieceBlockInfo {
@@ -132,11 +163,29 @@ private:
 	};
 
 	bitset m_bitset;
-	std::vector<Piece *> m_queue;
+	RingBuffer m_input;
+	size_t m_maxMessage;
+	std::vector<Download> m_queue;
 	std::vector<PieceBlockInfo> m_requestedBlocks;
+	std::deque<BlockRequest> m_outstanding;
 	std::string m_peerId;
 	uint8_t m_state;
 
+	// Lowest request round trip seen, together with the download rate it
+	// sizes m_outstanding.
+	Clock::duration m_minRtt;
+
+	// Payload both ways, counted towards the torrent's meters too
+	RateMeter m_downloadMeter;
+	RateMeter m_uploadMeter;
+	std::shared_ptr<RateLimiter> m_uploadLimiter;	// shared with the connection
+	std::shared_ptr<RateLimiter> m_downloadLimiter;
+
+	// Block being read in place into its piece
+	bool m_receiving;
+	uint32_t m_receivingIndex;
+	uint32_t m_receivingBegin;
+
 	Torrent *m_torrent;
 	ConnectionPtr m_conn;
 
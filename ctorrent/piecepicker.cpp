@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "piecepicker.h"
+
+#include <algorithm>
+
+const size_t PiecePicker::None;
+
+void PiecePicker::init(size_t pieces)
+{
+	m_order.resize(pieces);
+	m_pos.resize(pieces);
+	for (size_t i = 0; i < pieces; ++i)
+		m_order[i] = m_pos[i] = i;
+
+	m_buckets.assign(1, 0);
+	m_availability.assign(pieces, 0);
+	m_requested.assign(pieces, 0);
+	m_unrequested = pieces;
+	m_deadlines.clear();
+	m_random.seed(std::random_device()());
+}
+
+size_t PiecePicker::bucketEnd(size_t availability) const
+{
+	if (availability + 1 < m_buckets.size())
+		return m_buckets[availability + 1];
+
+	return m_order.size();
+}
+
+void PiecePicker::swapAt(size_t a, size_t b)
+{
+	std::swap(m_order[a], m_order[b]);
+	m_pos[m_order[a]] = a;
+	m_pos[m_order[b]] = b;
+}
+
+void PiecePicker::have(size_t index)
+{
+	if (index >= m_pos.size() || m_pos[index] == None)
+		return;
+
+	// Walk it up to the end of the array one bucket at a time: it swaps with
+	// the last piece of its bucket, which the next bucket then grows into.
+	size_t pos = m_pos[index];
+	for (size_t a = m_availability[index]; a < m_buckets.size(); ++a) {
+		size_t last = bucketEnd(a) - 1;
+		swapAt(pos, last);
+		pos = last;
+		if (a + 1 < m_buckets.size())
+			m_buckets[a + 1] = last;
+	}
+
+	m_order.pop_back();
+	m_pos[index] = None;
+	if (!m_requested[index])
+		--m_unrequested;
+}
+
+void PiecePicker::incAvailability(size_t index)
+{
+	if (index >= m_pos.size())
+		return;
+
+	size_t a = m_availability[index]++;
+	if (m_pos[index] == None)
+		return;
+
+	if (a + 1 >= m_buckets.size())
+		m_buckets.push_back(m_order.size());
+
+	size_t last = m_buckets[a + 1] - 1;
+	swapAt(m_pos[index], last);
+	--m_buckets[a + 1];
+}
+
+void PiecePicker::decAvailability(size_t index)
+{
+	if (index >= m_pos.size() || m_availability[index] == 0)
+		return;
+
+	size_t a = m_availability[index]--;
+	if (m_pos[index] == None)
+		return;
+
+	size_t first = m_buckets[a];
+	swapAt(m_pos[index], first);
+	++m_buckets[a];
+}
+
+void PiecePicker::release(size_t index)
+{
+	if (index >= m_requested.size() || m_requested[index] == 0)
+		return;
+
+	if (--m_requested[index] == 0 && m_pos[index] != None)
+		++m_unrequested;
+}
+
+void PiecePicker::join(size_t index)
+{
+	if (index >= m_requested.size())
+		return;
+
+	if (m_pos[index] == None)
+		++m_requested[index];
+	else
+		take(index);
+}
+
+void PiecePicker::setDeadlines(const Deadlines &deadlines)
+{
+	std::vector<Deadline> old;
+	old.swap(m_deadlines);
+
+	m_deadlines.reserve(deadlines.size());
+	for (const auto &d : deadlines) {
+		if (d.first >= m_pos.size() || m_pos[d.first] == None)
+			continue;
+
+		auto dup = std::find_if(m_deadlines.begin(), m_deadlines.end(),
+					[&d] (const Deadline &e) { return e.index == d.first; });
+		if (dup != m_deadlines.end()) {
+			dup->due = std::min(dup->due, d.second);
+			continue;
+		}
+
+		// Keep track of when it was handed out for pieces already in flight
+		Deadline entry = { d.first, d.second, Clock::time_point() };
+		for (const Deadline &o : old) {
+			if (o.index == d.first) {
+				entry.handedOut = o.handedOut;
+				break;
+			}
+		}
+
+		m_deadlines.push_back(entry);
+	}
+
+	std::sort(m_deadlines.begin(), m_deadlines.end(),
+		  [] (const Deadline &lhs, const Deadline &rhs) { return lhs.due < rhs.due; });
+}
+
+size_t PiecePicker::take(size_t index)
+{
+	if (m_requested[index]++ == 0)
+		--m_unrequested;
+	return index;
+}
+
+size_t PiecePicker::pick(const bitset &peer, const atomic_bitset &skip, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut)
+{
+	if (m_order.empty())
+		return None;
+
+	if (fast) {
+		Clock::time_point now = Clock::now();
+		for (Deadline &d : m_deadlines) {
+			size_t p = d.index;
+			if (m_pos[p] == None || !peer.test(p) || skip.test(p))
+				continue;
+
+			if (m_requested[p]) {
+				bool atRisk = now - d.handedOut > (d.due - d.handedOut) / 2;
+				if (!atRisk || m_requested[p] >= MaxCopies || downloading(p))
+					continue;
+			}
+
+			d.handedOut = now;
+			return take(p);
+		}
+	}
+
+	// Nothing to trade yet, rarity doesn't matter as much as getting any
+	// piece at all soon.
+	size_t index = None;
+	if (m_pos.size() - m_order.size() < RandomFirst) {
+		size_t start = std::uniform_int_distribution<size_t>(0, m_order.size() - 1)(m_random);
+		for (size_t i = 0; i < m_order.size(); ++i) {
+			size_t p = m_order[(start + i) % m_order.size()];
+			if (peer.test(p) && !skip.test(p) && !m_requested[p]) {
+				index = p;
+				break;
+			}
+		}
+	}
+
+	// Pieces no peer has (bucket 0) are of no interest here.  In end-game
+	// go for the least requested one if everything the peer has is taken.
+	size_t fallback = None;
+	bool duplicate = blocksOut && endGame();
+	for (size_t i = bucketEnd(0); index == None && i < m_order.size(); ++i) {
+		size_t p = m_order[i];
+		if (!peer.test(p) || skip.test(p))
+			continue;
+
+		if (!m_requested[p])
+			index = p;
+		else if (duplicate && (fallback == None || m_requested[p] < m_requested[fallback]) && !downloading(p))
+			fallback = p;
+	}
+
+	if (index == None)
+		index = fallback;
+	if (index != None)
+		take(index);
+	return index;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __PIECEPICKER_H
+#define __PIECEPICKER_H
+
+#include <util/bitset.h>
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <limits>
+
+// Rarest-first piece selection.  Pieces we don't have yet are kept in one
+// array sorted by how many peers have them, with the start of each
+// availability bucket remembered, so a change in availability is a swap
+// across a bucket boundary and picking starts right at the rarest pieces.
+//
+// Pieces can also be given a deadline (streaming), those go first to fast
+// peers, earliest deadline first.  One that has used up half of its time
+// since it was handed out is considered at risk and handed out again.
+//
+// Not thread safe, the owner locks.
+class PiecePicker {
+public:
+	enum {
+		RandomFirst = 4,	// pick at random until we have this many
+		MaxCopies = 3		// peers an at risk piece is requested from
+	};
+
+	typedef std::chrono::steady_clock Clock;
+	typedef std::vector<std::pair<size_t, Clock::time_point>> Deadlines;
+
+	static const size_t None = std::numeric_limits<size_t>::max();
+
+	void init(size_t pieces);
+
+	// We have this piece now, it won't be picked again
+	void have(size_t index);
+
+	void incAvailability(size_t index);
+	void decAvailability(size_t index);
+
+	// Pieces handed to a peer are only picked again in end-game, release()
+	// once the peer is done with it one way or another.
+	void release(size_t index);
+
+	// Another peer helps out with a piece that is already handed out,
+	// release() it the same way.
+	void join(size_t index);
+
+	// Every piece we still need has been handed out.  End-game proper also
+	// needs every block of them requested, which only the owner knows, see
+	// pick().
+	bool endGame() const { return !m_order.empty() && m_unrequested == 0; }
+
+	// Replaces all deadlines
+	void setDeadlines(const Deadlines &deadlines);
+
+	// Best piece that peer has and that isn't skipped, None if there isn't
+	// any.  downloading tells whether the peer already has it in progress,
+	// fast whether it should get time critical pieces.  Once blocksOut
+	// (every block of the pieces handed out is requested) and in endGame(),
+	// pieces are handed out again to whoever has them.
+	size_t pick(const bitset &peer, const atomic_bitset &skip, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut);
+
+protected:
+	struct Deadline {
+		size_t index;
+		Clock::time_point due;
+		Clock::time_point handedOut;
+	};
+
+	size_t bucketEnd(size_t availability) const;
+	void swapAt(size_t a, size_t b);
+	size_t take(size_t index);
+
+private:
+	std::vector<size_t> m_order;		// pieces we want, by availability
+	std::vector<size_t> m_pos;		// piece -> position in m_order
+	std::vector<size_t> m_buckets;		// availability -> first position in m_order
+	std::vector<uint32_t> m_availability;
+	std::vector<uint16_t> m_requested;	// peers downloading the piece
+	size_t m_unrequested;			// pieces in m_order nobody is downloading
+	std::vector<Deadline> m_deadlines;	// by due time
+	std::mt19937 m_random;
+};
+
+#endif
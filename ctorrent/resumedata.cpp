@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "resumedata.h"
+
+#include <bencode/bencode.h>
+#include <util/auxiliar.h>
+#include <util/serializer.h>
+
+#include <cstdio>
+#include <fcntl.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifdef _WIN32
+#define fsync(fd)	_commit(fd)
+#endif
+
+static const size_t journalRecordSize = 24;
+
+bool ResumeFileState::fromFd(int fd, ResumeFileState &state)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+
+	state.size = st.st_size;
+#if defined(__linux__)
+	state.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+	state.mtime = (uint64_t)st.st_mtime * 1000000000ULL;
+#endif
+	return true;
+}
+
+ResumeData::ResumeData()
+	: m_journal(-1)
+{
+	memset(m_infoHash, 0, sizeof(m_infoHash));
+}
+
+ResumeData::~ResumeData()
+{
+	if (m_journal >= 0)
+		close(m_journal);
+}
+
+void ResumeData::setPath(const std::string &path, const uint32_t *infoHash)
+{
+	m_path = path;
+	memcpy(m_infoHash, infoHash, sizeof(m_infoHash));
+}
+
+bool ResumeData::openJournal(bool truncate)
+{
+	if (m_journal >= 0)
+		close(m_journal);
+
+	int flags = O_WRONLY | O_CREAT | O_APPEND | O_BINARY;
+	if (truncate)
+		flags |= O_TRUNC;
+
+	m_journal = open((m_path + ".journal").c_str(), flags, 0644);
+	return m_journal >= 0;
+}
+
+bool ResumeData::load(bitset &completed, std::vector<ResumeFileState> &files)
+{
+	Bencode bencode;
+	Dictionary dict = bencode.decode(m_path);
+	if (dict.empty())
+		return false;
+
+	uint8_t infoHash[20];
+	for (size_t i = 0; i < 5; ++i)
+		writeBE32(&infoHash[i * 4], m_infoHash[i]);
+
+	std::string hash = Bencode::cast<std::string>(dict["info hash"]);
+	if (hash.size() != sizeof(infoHash) || memcmp(hash.c_str(), infoHash, sizeof(infoHash)) != 0)
+		return false;
+
+	std::string bits = Bencode::cast<std::string>(dict["bitfield"]);
+	VectorType fileList = Bencode::cast<VectorType>(dict["files"]);
+	if (Bencode::cast<uint64_t>(dict["pieces"]) != completed.size() ||
+	    bits.size() != completed.size() || fileList.size() != files.size())
+		return false;
+
+	completed.raw_set((const uint8_t *)bits.c_str(), bits.size());
+	for (size_t i = 0; i < fileList.size(); ++i) {
+		Dictionary f = Bencode::cast<Dictionary>(fileList[i]);
+		files[i].size = Bencode::cast<uint64_t>(f["length"]);
+		files[i].mtime = Bencode::cast<uint64_t>(f["mtime"]);
+	}
+
+	// Replay the journal, a torn record at the end (crash mid-append) is
+	// just ignored.
+	FILE *fp = fopen((m_path + ".journal").c_str(), "rb");
+	if (fp) {
+		uint8_t buf[journalRecordSize];
+		while (fread(buf, 1, sizeof(buf), fp) == sizeof(buf)) {
+			JournalRecord r;
+			r.piece = readBE32(&buf[0]);
+			r.file = readBE32(&buf[4]);
+			r.size = readBE64(&buf[8]);
+			r.mtime = readBE64(&buf[16]);
+			if (r.piece >= completed.size() || r.file >= files.size())
+				continue;
+
+			completed.set(r.piece);
+			files[r.file].size = r.size;
+			files[r.file].mtime = r.mtime;
+		}
+
+		fclose(fp);
+	}
+
+	return true;
+}
+
+bool ResumeData::save(const bitset &completed, const std::vector<ResumeFileState> &files)
+{
+	uint8_t infoHash[20];
+	for (size_t i = 0; i < 5; ++i)
+		writeBE32(&infoHash[i * 4], m_infoHash[i]);
+
+	VectorType fileList;
+	fileList.reserve(files.size());
+	for (const ResumeFileState &s : files) {
+		Dictionary f;
+		f["length"] = s.size;
+		f["mtime"] = s.mtime;
+		fileList.push_back(f);
+	}
+
+	Dictionary dict;
+	dict["info hash"] = std::string((const char *)infoHash, sizeof(infoHash));
+	dict["pieces"] = (uint64_t)completed.size();
+	dict["bitfield"] = std::string((const char *)completed.bits(), completed.size());
+	dict["files"] = fileList;
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_pending.clear();
+
+	Bencode bencode;
+	bencode.encode(dict);
+
+	size_t size;
+	const char *buffer = bencode.buffer(0, size);
+
+	std::string tmp = m_path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0)
+		return false;
+
+	bool ok = write(fd, buffer, size) == (ssize_t)size && fsync(fd) == 0;
+	close(fd);
+#ifdef _WIN32
+	remove(m_path.c_str());
+#endif
+	if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+
+	// Everything in the journal is part of the snapshot now
+	return openJournal(true);
+}
+
+void ResumeData::journal(size_t piece, const std::vector<std::pair<size_t, ResumeFileState>> &files)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	size_t pos = m_pending.size();
+	m_pending.resize(pos + files.size() * journalRecordSize);
+
+	uint8_t *p = &m_pending[pos];
+	for (const auto &f : files) {
+		writeBE32(&p[0], piece);
+		writeBE32(&p[4], f.first);
+		writeBE64(&p[8], f.second.size);
+		writeBE64(&p[16], f.second.mtime);
+		p += journalRecordSize;
+	}
+}
+
+bool ResumeData::hasPending()
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	return !m_pending.empty();
+}
+
+void ResumeData::flush(const std::function<void ()> &syncData)
+{
+	std::lock_guard<std::mutex> flushing(m_flushMutex);
+	std::vector<uint8_t> records;
+	m_mutex.lock();
+	records.swap(m_pending);
+	m_mutex.unlock();
+
+	if (records.empty())
+		return;
+
+	// The pieces we're about to journal must hit the disk before their
+	// records do.
+	syncData();
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	if (m_journal < 0)
+		return;
+
+	if (write(m_journal, records.data(), records.size()) != (ssize_t)records.size()) {
+		// Don't risk misaligned records, the snapshot on exit covers them
+		close(m_journal);
+		m_journal = -1;
+		return;
+	}
+
+	fsync(m_journal);
+}
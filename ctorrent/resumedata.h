@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RESUMEDATA_H
+#define __RESUMEDATA_H
+
+#include <util/bitset.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+struct ResumeFileState {
+	uint64_t size;
+	uint64_t mtime;		// nanoseconds where the platform has them
+
+	bool operator==(const ResumeFileState &o) const { return size == o.size && mtime == o.mtime; }
+	bool operator!=(const ResumeFileState &o) const { return !(*this == o); }
+
+	static bool fromFd(int fd, ResumeFileState &state);
+};
+
+// Fast-resume state for a single torrent.  A bencoded snapshot holds the
+// completed bitfield and the size/mtime of every file as of when it was taken,
+// pieces completed after that are appended to a journal together with the
+// new state of the files they touched.  Journal records are buffered and
+// flushed every few seconds, after the data they describe has been synced.
+// The snapshot is always replaced atomically (write to a temporary and
+// rename.)
+class ResumeData {
+public:
+	ResumeData();
+	~ResumeData();
+
+	void setPath(const std::string &path, const uint32_t *infoHash);
+
+	// Snapshot + journal replay, false if there's nothing usable.
+	bool load(bitset &completed, std::vector<ResumeFileState> &files);
+	bool save(const bitset &completed, const std::vector<ResumeFileState> &files);
+
+	// Record a completed piece and the state of the files it was written to
+	void journal(size_t piece, const std::vector<std::pair<size_t, ResumeFileState>> &files);
+	bool hasPending();
+
+	// Write out buffered records, syncData is called before that and must
+	// make sure the pieces they describe are on disk.  One flush at a time,
+	// so a record never gets ahead of a sync still running in another.
+	void flush(const std::function<void ()> &syncData);
+
+private:
+	struct JournalRecord {
+		uint32_t piece;
+		uint32_t file;
+		uint64_t size;
+		uint64_t mtime;
+	};
+
+	bool openJournal(bool truncate);
+
+	std::string m_path;
+	uint32_t m_infoHash[5];
+	int m_journal;
+	std::vector<uint8_t> m_pending;
+	std::mutex m_mutex;
+	std::mutex m_flushMutex;	// held for a whole flush()
+};
+
+#endif
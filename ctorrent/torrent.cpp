@@ -29,17 +29,31 @@
 #include <thread>
 #include <random>
 #include <fstream>
-#include <future>
+#include <limits>
 
 extern std::ofstream logfile;
 
+RateMeter g_downloadMeter;
+RateMeter g_uploadMeter;
+
 Torrent::Torrent()
 	: m_listener(nullptr),
+	  m_announceTimer(g_service),
+	  m_rateTimer(g_service),
+	  m_chokeTimer(g_service),
+	  m_maxPeers(0),
+	  m_drainPosted(false),
 	  m_fileManager(this),
-	  m_uploadedBytes(0),
+	  m_downloadMeter(&g_downloadMeter),
+	  m_uploadMeter(&g_uploadMeter),
+	  m_uploadLimiter(&g_uploadLimiter),
+	  m_downloadLimiter(&g_downloadLimiter),
+	  m_limitLocal(false),
 	  m_downloadedBytes(0),
 	  m_wastedBytes(0),
-	  m_hashMisses(0)
+	  m_hashMisses(0),
+	  m_redundantBytes(0),
+	  m_streamRate(0)
 {
 
 }
@@ -56,7 +70,7 @@ Torrent::~Torrent()
 	delete m_listener;
 }
 
-bool Torrent::open(const std::string &fileName, const std::string &downloadDir)
+bool Torrent::open(const std::string &fileName, const std::string &downloadDir, StorageMode mode)
 {
 	if (!m_meta.parse(fileName))
 		return false;
@@ -82,39 +96,28 @@ bool Torrent::open(const std::string &fileName, const std::string &downloadDir)
 	if (!ends_with(dir, PATH_SEP))
 		dir += PATH_SEP;
 
-	return m_fileManager.registerFiles(dir, m_meta.files());
-}
-
-double Torrent::eta()
-{
-	clock_t elapsed_s = elapsed() / CLOCKS_PER_SEC;
-	size_t downloaded = computeDownloaded();
-	return (double)(m_meta.totalSize() - downloaded) * elapsed_s / (double)downloaded;
+	return m_fileManager.registerFiles(dir, m_meta.files(), mode);
 }
 
-double Torrent::downloadSpeed()
+double Torrent::eta() const
 {
-	clock_t elapsed_s = elapsed() / CLOCKS_PER_SEC;
-	size_t downloaded = computeDownloaded();
-	if (elapsed_s == 0)
-		return 0.0f;
-
-	double speed = (double)(downloaded / elapsed_s);
-	return (speed / 1024) * 0.0125;
-}
-
-clock_t Torrent::elapsed()
-{
-	return clock() - m_startTime;
+	size_t remaining = m_meta.totalSize() - completedBytes();
+	double speed = m_downloadMeter.rate();
+	if (remaining == 0)
+		return 0.0;
+	if (speed == 0)
+		return std::numeric_limits<double>::infinity();
+
+	return remaining / speed;
 }
 
 TrackerQuery Torrent::makeTrackerQuery(TrackerEvent event)
 {
-	size_t downloaded = computeDownloaded();
+	size_t downloaded = completedBytes();
 	TrackerQuery q = {
 		.event = event,
 		.downloaded = downloaded,
-		.uploaded = m_uploadedBytes,
+		.uploaded = uploadedBytes(),
 		.remaining = m_meta.totalSize() - downloaded
 	};
 
@@ -132,14 +135,35 @@ Torrent::DownloadState Torrent::prepare(uint16_t port, bool seeder)
 	if (!queryTrackers(makeTrackerQuery(TrackerEvent::Started), seeder ? port : 0))
 		return DownloadState::TrackerQueryFailure;
 
-	m_startTime = clock();
 	return DownloadState::None;
 }
 
+void Torrent::start(size_t maxPeers)
+{
+	m_maxPeers = maxPeers;
+	nextConnection();
+	scheduleAnnounce();
+	scheduleRateTick();
+	scheduleChoke();
+}
+
+void Torrent::stop()
+{
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
+	boost::system::error_code ec;
+	m_announceTimer.cancel(ec);
+	m_rateTimer.cancel(ec);
+	m_chokeTimer.cancel(ec);
+	if (m_listener)
+		m_listener->stop();
+	disconnectPeers();
+}
+
 bool Torrent::finish()
 {
-	TrackerEvent event = isFinished() ? TrackerEvent::Completed : TrackerEvent::Stopped;
-	TrackerQuery q = makeTrackerQuery(event);
+	stop();
+
+	TrackerQuery q = makeTrackerQuery(TrackerEvent::Stopped);
 	for (auto it = m_activeTrackers.begin(); it != m_activeTrackers.end();) {
 		Tracker *tracker = *it;
 		tracker->query(q);
@@ -147,29 +171,115 @@ bool Torrent::finish()
 		delete tracker;
 	}
 
-	return !!(event == TrackerEvent::Completed);
+	return isFinished();
 }
 
-bool Torrent::checkTrackers()
+void Torrent::checkTrackers()
 {
-	for (Tracker *tracker : m_activeTrackers)
-		if (tracker->timeUp())
-			std::async(std::launch::async, std::bind(&Tracker::query, tracker, makeTrackerQuery(TrackerEvent::None)));
-	return true;
+	if (m_maxPeers == 0 || activePeers() < m_maxPeers)
+		for (Tracker *tracker : m_activeTrackers)
+			if (tracker->timeUp())
+				tracker->query(makeTrackerQuery(TrackerEvent::None));
+
+	scheduleAnnounce();
 }
 
-bool Torrent::nextConnection()
+void Torrent::scheduleAnnounce()
 {
-	if (m_listener) {
-		m_listener->accept([this] (const ConnectionPtr &c) {
-			auto peer = std::make_shared<Peer>(c, this);
-			peer->verify();
-		});
+	if (m_activeTrackers.empty())
+		return;
 
-		return true;
+	TimePoint next = m_activeTrackers.front()->nextRequestTime();
+	for (const Tracker *tracker : m_activeTrackers)
+		next = std::min(next, tracker->nextRequestTime());
+
+	int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::system_clock::now()).count();
+	if (m_maxPeers != 0 && activePeers() >= m_maxPeers)
+		ms = std::max<int64_t>(ms, FullRetry);
+
+	m_announceTimer.expires_from_now(boost::posix_time::milliseconds(std::max<int64_t>(ms, 0)));
+	m_announceTimer.async_wait([this] (const boost::system::error_code &e) {
+		if (!e)
+			checkTrackers();
+	});
+}
+
+void Torrent::scheduleRateTick()
+{
+	m_rateTimer.expires_from_now(boost::posix_time::milliseconds((long)RateMeter::TickInterval));
+	m_rateTimer.async_wait([this] (const boost::system::error_code &e) {
+		if (!e)
+			tickRates();
+	});
+}
+
+void Torrent::tickRates()
+{
+	std::unique_lock<std::recursive_mutex> lock(m_mutex);
+	for (const auto &it : m_peers) {
+		it.second->m_downloadMeter.tick();
+		it.second->m_uploadMeter.tick();
 	}
+	lock.unlock();
 
-	return false;
+	m_downloadMeter.tick();
+	m_uploadMeter.tick();
+	g_downloadMeter.tick();
+	g_uploadMeter.tick();
+	scheduleRateTick();
+}
+
+void Torrent::scheduleChoke()
+{
+	m_chokeTimer.expires_from_now(boost::posix_time::seconds((long)Choker::Interval));
+	m_chokeTimer.async_wait([this] (const boost::system::error_code &e) {
+		if (!e)
+			runChoker();
+	});
+}
+
+void Torrent::runChoker()
+{
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
+
+	// Once we seed there's nothing to get back, reward those that take it
+	// fastest instead.
+	bool seeding = isFinished();
+	std::vector<Choker::Candidate> candidates;
+	for (const auto &it : m_peers) {
+		const PeerPtr &peer = it.second;
+		if (!peer->isRemoteInterested())
+			continue;
+
+		const RateMeter &meter = seeding ? peer->m_uploadMeter : peer->m_downloadMeter;
+		candidates.push_back(Choker::Candidate { it.first, meter.rate() });
+	}
+
+	std::vector<uint32_t> unchoke = m_choker.run(candidates, m_uploadMeter.rate());
+	for (const auto &it : m_peers) {
+		const PeerPtr &peer = it.second;
+		bool wanted = std::find(unchoke.begin(), unchoke.end(), it.first) != unchoke.end();
+		if (wanted && peer->isLocalChoked())
+			peer->sendUnchoke();
+		else if (!wanted && !peer->isLocalChoked())
+			peer->sendChoke();
+	}
+
+	scheduleChoke();
+}
+
+bool Torrent::nextConnection()
+{
+	if (!m_listener || m_listener->stopped())
+		return false;
+
+	m_listener->accept([this] (const ConnectionPtr &c) {
+		std::lock_guard<std::recursive_mutex> guard(m_mutex);
+		auto peer = std::make_shared<Peer>(c, this);
+		peer->verify();
+		nextConnection();
+	});
+	return true;
 }
 
 bool Torrent::queryTrackers(const TrackerQuery &query, uint16_t port)
@@ -253,6 +363,7 @@ void Torrent::rawConnectPeer(Dictionary &peerInfo)
 
 void Torrent::connectToPeers(const boost::any &_peers)
 {
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
 	if (isFinished())
 		return;
 
@@ -301,76 +412,318 @@ void Torrent::addPeer(const PeerPtr &peer)
 void Torrent::removePeer(const PeerPtr &peer, const std::string &errmsg)
 {
 	auto it = m_peers.find(peer->ip());
-	if (it != m_peers.end())
+	if (it != m_peers.end()) {
+		m_fileManager.removeAvailability(&peer->m_bitset);
+		peer->releasePieces();
 		m_peers.erase(it);
+	}
+
+	m_fileManager.cancelRequests(peer->ip());
 
 	logfile << peer->getIP() << ": closing link: " << errmsg << std::endl;
 }
 
 void Torrent::disconnectPeers()
 {
-	for (auto it : m_peers)
+	for (auto it : m_peers) {
 		it.second->disconnect();
+		m_fileManager.removeAvailability(&it.second->m_bitset);
+		it.second->releasePieces();
+		m_fileManager.cancelRequests(it.first);
+	}
 	m_peers.clear();
 }
 
 void Torrent::sendBitfield(const PeerPtr &peer)
 {
-	const bitset *b = m_fileManager.completedBits();
+	const atomic_bitset *b = m_fileManager.completedBits();
 	if (b->count() == 0)
 		return;
 
-	uint8_t bits[b->size()];
+	size_t size = (b->size() + 7) / 8;
+	std::vector<uint8_t> bits(size, 0);
 	for (size_t i = 0; i < b->size(); ++i)
 		if (b->test(i))
-			bits[i] = b->bitsAt(i) & (1 << (7 - (i & 7)));
-	peer->sendBitfield(&bits[0], b->size());
+			bits[i >> 3] |= 1 << (7 - (i & 7));
+	peer->sendBitfield(bits.data(), size);
+}
+
+// Fast peers finish what others started before starting anything new,
+// unless streaming where the deadlines come first.
+bool Torrent::requestPiece(const PeerPtr &peer)
+{
+	auto downloading = std::bind(&Peer::isDownloading, peer, std::placeholders::_1);
+	bool fast = isFastPeer(peer);
+
+	if (fast && !m_streamRate) {
+		size_t index = m_blocks.partial(peer->m_bitset, downloading);
+		if (index != BlockTable::None) {
+			m_fileManager.joinPiece(index);
+			peer->queuePiece(index, false);
+			return true;
+		}
+	}
+
+	// End-game only once every block is requested, until then whatever is
+	// left free in the pieces handed out comes first.
+	bool blocksOut = m_blocks.freeBlocks() == 0;
+	size_t index = m_fileManager.getPieceforRequest(&peer->m_bitset, downloading, fast, blocksOut);
+	if (index == std::numeric_limits<size_t>::max()) {
+		index = blocksOut ? BlockTable::None : m_blocks.partial(peer->m_bitset, downloading);
+		if (index == BlockTable::None)
+			return false;
+
+		m_fileManager.joinPiece(index);
+		peer->queuePiece(index, false);
+		return true;
+	}
+
+	bool duplicate = m_blocks.find(index) != nullptr;
+	m_blocks.add(index, m_fileManager.pieceSize(index));
+	peer->queuePiece(index, duplicate);
+	return true;
+}
+
+// Faster than at least half of the peers that aren't choking us
+bool Torrent::isFastPeer(const PeerPtr &peer) const
+{
+	double rate = peer->downloadRate();
+	size_t faster = 0;
+	size_t total = 0;
+
+	for (const auto &it : m_peers) {
+		if (it.second->isRemoteChoked())
+			continue;
+
+		++total;
+		if (it.second->downloadRate() > rate)
+			++faster;
+	}
+
+	return faster <= total / 2;
+}
+
+void Torrent::setStreamRate(size_t rate)
+{
+	m_streamRate = rate;
+	m_readCursors.resize(m_meta.files().size(), 0);
+	updateDeadlines();
+}
+
+void Torrent::setReadCursor(size_t file, uint64_t offset)
+{
+	m_readCursors.resize(m_meta.files().size(), 0);
+	if (file < m_readCursors.size()) {
+		m_readCursors[file] = offset;
+		updateDeadlines();
+	}
 }
 
-void Torrent::requestPiece(const PeerPtr &peer)
+// Looks StreamWindow seconds (at least 2 pieces) ahead of every cursor
+void Torrent::updateDeadlines()
 {
-	size_t index = m_fileManager.getPieceforRequest(std::bind(&Peer::hasPiece, peer, std::placeholders::_1));
-	if (index != std::numeric_limits<size_t>::max())
-		peer->sendPieceRequest(index);
+	PieceDeadlines deadlines;
+	if (m_streamRate == 0)
+		return m_fileManager.setPieceDeadlines(deadlines);
+
+	auto now = std::chrono::steady_clock::now();
+	const TorrentFiles files = m_meta.files();
+	uint64_t pieceLength = m_meta.pieceLength();
+	uint64_t window = std::max<uint64_t>((uint64_t)m_streamRate * StreamWindow, 2 * pieceLength);
+
+	for (size_t f = 0; f < files.size(); ++f) {
+		const TorrentFileInfo &inf = files[f];
+		if (m_readCursors[f] >= inf.length)
+			continue;
+
+		uint64_t cursor = inf.begin + m_readCursors[f];
+		uint64_t end = std::min<uint64_t>(inf.begin + inf.length, cursor + window);
+		for (uint64_t p = cursor / pieceLength; p * pieceLength < end; ++p) {
+			if (m_fileManager.pieceDone(p))
+				continue;
+
+			uint64_t ahead = p * pieceLength > cursor ? p * pieceLength - cursor : 0;
+			deadlines.push_back(std::make_pair(p, now + std::chrono::microseconds(ahead * 1000000 / m_streamRate)));
+		}
+	}
+
+	m_fileManager.setPieceDeadlines(deadlines);
 }
 
-bool Torrent::handlePieceCompleted(const PeerPtr &peer, uint32_t index, DataBuffer<uint8_t> &&data)
+void Torrent::handlePieceCompleted(const PeerPtr &peer, uint32_t index)
 {
+	BlockTable::Piece *piece = m_blocks.find(index);
+	if (!piece)
+		return;
+
+	uint32_t digest[5];
+	piece->sha1.finish(digest);
+
+	std::unordered_set<uint32_t> from;
+	for (const BlockTable::Block &b : piece->blocks)
+		from.insert(b.peer);
+
+	DataBuffer<uint8_t> data(std::move(piece->data));
+	m_blocks.remove(index);
+
+	// Everyone working on it is done with it, one way or another
+	for (const auto &it : m_peers)
+		it.second->dropPiece(index);
+
 	logfile << peer->getIP() << ": finished downloading piece: " << index << std::endl;
-	if (m_fileManager.writePieceBlock(index, peer->ip(), std::move(data)))
-		return true;
 
-	m_wastedBytes += data.size();
-	++m_hashMisses;
-	return false;
+	if (!m_fileManager.writePieceBlock(index, peer->ip(), std::move(data), digest)) {
+		m_redundantBytes += m_fileManager.pieceSize(index);
+		return;
+	}
+
+	// Held until the verdict comes back, a miss is on all of them
+	m_pieceSenders[index].assign(from.begin(), from.end());
+}
+
+void Torrent::handleRedundantBlock(const PeerPtr &peer, size_t size)
+{
+	m_redundantBytes += size;
+}
+
+// Peer got a block others were asked for too (end-game)
+void Torrent::cancelBlock(const PeerPtr &peer, uint32_t index, uint32_t begin)
+{
+	for (const auto &it : m_peers)
+		if (it.second != peer)
+			it.second->cancelBlock(index, begin);
 }
 
 bool Torrent::handleRequestBlock(const PeerPtr &peer, uint32_t index, uint32_t begin, uint32_t length)
 {
 	logfile << peer->getIP() << ": Requested piece block: " << index << std::endl;
+
+	// No need to read it if the kernel can send it straight from the file
+	int fd;
+	uint64_t offset;
+	if (m_fileManager.blockFile(index, begin, length, fd, offset)) {
+		peer->handlePieceBlockFile(index, begin, fd, offset, length);
+		return true;
+	}
+
 	return m_fileManager.requestPieceBlock(index, peer->ip(), begin, length);
 }
 
 void Torrent::onPieceWriteComplete(uint32_t from, size_t index)
 {
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
 	logfile << ip2str(from) << ": Finished writing piece: " << index << std::endl;
 	logfile << "Pieces so far: " << m_fileManager.completedPieces() << "/" << m_fileManager.totalPieces() << std::endl;
 
+	m_pieceSenders.erase(index);
 	m_downloadedBytes += m_fileManager.pieceSize(index);
+	if (m_streamRate)
+		updateDeadlines();
 	for (const auto &it : m_peers)
 		if (it.second->ip() != from && !it.second->hasPiece(index))
 			it.second->sendHave(index);
+
+	if (isFinished())
+		g_service.post(std::bind(&Torrent::handleFinished, this));
+}
+
+void Torrent::postPieceWritten(uint32_t from, size_t index)
+{
+	postCompletion(DiskCompletion { DiskCompletion::Written, from, index, 0, 0, nullptr, nullptr });
 }
 
-void Torrent::onPieceReadComplete(uint32_t from, size_t index, int64_t begin, uint8_t *block, size_t size)
+void Torrent::postPieceHashFailed(uint32_t from, size_t index, size_t size)
 {
+	postCompletion(DiskCompletion { DiskCompletion::HashFailed, from, index, 0, size, nullptr, nullptr });
+}
+
+void Torrent::postPieceRead(uint32_t from, size_t index, int64_t begin, const SharedBuffer &buffer, const uint8_t *block, size_t size)
+{
+	postCompletion(DiskCompletion { DiskCompletion::Read, from, index, begin, size, buffer, block });
+}
+
+void Torrent::postCompletion(DiskCompletion &&c)
+{
+	// Only the first completion after a drain has to wake the loop
+	m_completions.push(std::move(c));
+	if (!m_drainPosted.exchange(true))
+		g_service.post(std::bind(&Torrent::drainCompletions, this));
+}
+
+void Torrent::drainCompletions()
+{
+	m_drainPosted = false;
+
+	DiskCompletion c;
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
+	while (m_completions.pop(c)) {
+		switch (c.kind) {
+		case DiskCompletion::Written:
+			onPieceWriteComplete(c.from, c.index);
+			break;
+		case DiskCompletion::HashFailed:
+			onPieceHashFailed(c.from, c.index, c.size);
+			break;
+		case DiskCompletion::Read:
+			onPieceReadComplete(c.from, c.index, c.begin, c.buffer, c.block, c.size);
+			break;
+		}
+	}
+
+	// A push that was still linking itself in when we looked
+	if (!m_completions.empty() && !m_drainPosted.exchange(true))
+		g_service.post(std::bind(&Torrent::drainCompletions, this));
+}
+
+void Torrent::onPieceHashFailed(uint32_t from, size_t index, size_t size)
+{
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
+	logfile << ip2str(from) << ": piece " << index << " failed the hash check" << std::endl;
+
+	m_wastedBytes += size;
+	++m_hashMisses;
+
 	auto it = m_peers.find(from);
-	if (it != m_peers.end()) {
-		it->second->sendPieceBlock(index, begin, block, size);
-		m_uploadedBytes += size;
+	if (it != m_peers.end())
+		it->second->sendChoke();
+
+	// No telling which block was bad, the others that sent one are in
+	// it as much as from.
+	auto senders = m_pieceSenders.find(index);
+	if (senders == m_pieceSenders.end())
+		return;
+
+	for (uint32_t ip : senders->second) {
+		auto it = m_peers.find(ip);
+		if (ip != from && it != m_peers.end()) {
+			logfile << ip2str(ip) << ": sent a block of piece " << index << " which failed the hash check" << std::endl;
+			it->second->sendChoke();
+		}
 	}
+	m_pieceSenders.erase(senders);
+}
+
+void Torrent::onPieceReadComplete(uint32_t from, size_t index, int64_t begin, const SharedBuffer &buffer, const uint8_t *block, size_t size)
+{
+	std::lock_guard<std::recursive_mutex> guard(m_mutex);
+	auto it = m_peers.find(from);
+	if (it == m_peers.end())
+		return;
+
+	if (buffer)
+		it->second->sendPieceBlock(index, begin, buffer, block - buffer->data(), size);
+	else
+		it->second->sendPieceBlock(index, begin, block, size);
+}
+
+void Torrent::handleFinished()
+{
+	TrackerQuery q = makeTrackerQuery(TrackerEvent::Completed);
+	for (Tracker *tracker : m_activeTrackers)
+		tracker->query(q);
 
-	delete []block;
+	if (m_finishedCallback)
+		m_finishedCallback();
 }
 
 void Torrent::handleTrackerError(Tracker *tracker, const std::string &error)
@@ -388,3 +741,19 @@ void Torrent::handleNewPeer(const PeerPtr &peer)
 	m_peers.insert(std::make_pair(peer->ip(), peer));
 	sendBitfield(peer);
 }
+
+// Take it right away while there are free slots, otherwise it waits for the
+// choker.
+void Torrent::handleInterested(const PeerPtr &peer)
+{
+	if (!peer->isLocalChoked())
+		return;
+
+	size_t unchoked = 0;
+	for (const auto &it : m_peers)
+		if (!it.second->isLocalChoked() && it.second->isRemoteInterested())
+			++unchoked;
+
+	if (unchoked < m_choker.slots())
+		peer->sendUnchoke();
+}
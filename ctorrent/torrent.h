@@ -26,16 +26,22 @@
 #include "tracker.h"
 #include "torrentmeta.h"
 #include "torrentfilemanager.h"
+#include "blocktable.h"
+#include "choker.h"
 
 #include <boost/any.hpp>
 #include <bencode/bencode.h>
 #include <net/server.h>
+#include <util/mpscqueue.h>
+#include <util/ratemeter.h>
 
 #include <vector>
 #include <map>
 #include <string>
 #include <chrono>
 #include <iosfwd>
+#include <mutex>
+#include <atomic>
 
 #include <unordered_map>
 #include <unordered_set>
@@ -43,6 +49,11 @@
 static size_t maxRequestSize = 16384;		// 16KiB initial (per piece)
 class Torrent
 {
+	enum {
+		StreamWindow = 10,	// seconds of read ahead in streaming mode
+		FullRetry = 1000	// ms before asking trackers again with enough peers
+	};
+
 public:
 	enum class DownloadState {
 		None			 = 0,
@@ -56,24 +67,52 @@ public:
 	~Torrent();
 
 	DownloadState prepare(uint16_t port, bool seeder);
-	bool checkTrackers();
-	bool open(const std::string& fileName, const std::string &downloadDir);
+	bool open(const std::string& fileName, const std::string &downloadDir, StorageMode mode = StorageMode::Buffered);
 	bool prepareforSeed(uint16_t port);
-	bool nextConnection();
+	// Re-announce to trackers when they ask for it (not while maxPeers are
+	// connected, 0 is no limit) and accept peers if seeding, from g_service,
+	// until stop() or finish().
+	void start(size_t maxPeers);
+	void stop();
 	bool finish();
 	bool isFinished() const { return m_fileManager.totalPieces() == m_fileManager.completedPieces(); }
+	// Called from g_service once the last piece is written
+	void setFinishedCallback(const std::function<void()> &cb) { m_finishedCallback = cb; }
 	bool hasTrackers() const { return !m_activeTrackers.empty(); }
 
-	size_t activePeers() const { return m_peers.size(); }
+	size_t activePeers() const { std::lock_guard<std::recursive_mutex> guard(m_mutex); return m_peers.size(); }
 	size_t downloadedBytes() const { return m_downloadedBytes; }
-	size_t uploadedBytes() const { return m_uploadedBytes; }
+	size_t uploadedBytes() const { return m_uploadMeter.total(); }
 	size_t wastedBytes() const { return m_wastedBytes; }
 	size_t hashMisses() const { return m_hashMisses; }
-	size_t computeDownloaded() { return m_fileManager.computeDownloaded(); }
-
-	double eta();
-	double downloadSpeed();
-	clock_t elapsed();
+	size_t redundantBytes() const { return m_redundantBytes; }
+	size_t completedBytes() const { return m_fileManager.completedBytes(); }
+
+	// Bytes per second, see RateMeter.  Peers' payload is counted here and
+	// in the session's meters, g_downloadMeter and g_uploadMeter.
+	RateMeter *downloadMeter() { return &m_downloadMeter; }
+	RateMeter *uploadMeter() { return &m_uploadMeter; }
+	double downloadSpeed() const { return m_downloadMeter.rate(); }
+	double uploadSpeed() const { return m_uploadMeter.rate(); }
+	double eta() const;
+
+	// Streaming: pieces ahead of each file's read cursor get deadlines as if
+	// the file was being read at rate bytes per second (0 turns it off) and
+	// are fetched first.  Cursors are offsets into the file.
+	void setStreamRate(size_t rate);
+	void setReadCursor(size_t file, uint64_t offset);
+
+	// Bytes per second, 0 is unlimited, may be changed at any time.  Peers
+	// on the local network are let through unless limitLocal is set.
+	void setUploadLimit(size_t limit) { m_uploadLimiter.setLimit(limit); }
+	void setDownloadLimit(size_t limit) { m_downloadLimiter.setLimit(limit); }
+	void setLimitLocal(bool limit) { m_limitLocal = limit; }
+	bool limitLocal() const { return m_limitLocal; }
+	RateLimiter *uploadLimiter() { return &m_uploadLimiter; }
+	RateLimiter *downloadLimiter() { return &m_downloadLimiter; }
+
+	// Peers we upload to at a time, 0 sizes it to our upload capacity
+	void setUploadSlots(size_t slots) { std::lock_guard<std::recursive_mutex> guard(m_mutex); m_choker.setSlots(slots); }
 
 	// Get associated meta info for this torrent
 	TorrentMeta *meta() { return &m_meta; }
@@ -81,14 +120,26 @@ public:
 	// Get associated file manager for this torrent
 	TorrentFileManager *fileManager() { return &m_fileManager; }
 
+	// Pieces being downloaded, shared by all peers
+	BlockTable *blocks() { return &m_blocks; }
+
 protected:
 	bool queryTrackers(const TrackerQuery &r, uint16_t port);
+	void checkTrackers();
+	void scheduleAnnounce();
+	void scheduleRateTick();
+	void tickRates();
+	void scheduleChoke();
+	void runChoker();
+	bool nextConnection();
 	bool queryTracker(const std::string &url, const TrackerQuery &r, uint16_t port);
 	void rawConnectPeers(const uint8_t *peers, size_t size);
 	void rawConnectPeer(Dictionary &peerInfo);
 	void connectToPeers(const boost::any &peers);
 	void sendBitfield(const PeerPtr &peer);
-	void requestPiece(const PeerPtr &peer);
+	bool requestPiece(const PeerPtr &peer);
+	bool isFastPeer(const PeerPtr &peer) const;
+	void updateDeadlines();
 
 	TrackerQuery makeTrackerQuery(TrackerEvent event);
 	void addBlacklist(uint32_t ip);
@@ -103,29 +154,78 @@ protected:
 	void handleTrackerError(Tracker *tracker, const std::string &error);
 	void handlePeerDebug(const PeerPtr &peer, const std::string &msg);
 	void handleNewPeer(const PeerPtr &peer);
-	bool handlePieceCompleted(const PeerPtr &peer, uint32_t index, DataBuffer<uint8_t> &&data);
+	void handleInterested(const PeerPtr &peer);
+	void handlePieceCompleted(const PeerPtr &peer, uint32_t index);
+	void handleRedundantBlock(const PeerPtr &peer, size_t size);
+	void cancelBlock(const PeerPtr &peer, uint32_t index, uint32_t begin);
 	bool handleRequestBlock(const PeerPtr &peer, uint32_t index, uint32_t begin, uint32_t length);
+	void handleFinished();
 
 public:
-	// TorrentFileManager -> Torrent
+	// TorrentFileManager -> Torrent, called from the disk threads.  The
+	// results are queued and handed to the onPiece* handlers in batches on
+	// the main network thread.  block lies in buffer, which is shared rather
+	// than copied, or in a file mapping when buffer is null.
+	void postPieceWritten(uint32_t from, size_t index);
+	void postPieceHashFailed(uint32_t from, size_t index, size_t size);
+	void postPieceRead(uint32_t from, size_t index, int64_t begin, const SharedBuffer &buffer, const uint8_t *block, size_t size);
+
+protected:
+	struct DiskCompletion {
+		enum Kind { Written, HashFailed, Read } kind;
+		uint32_t from;
+		size_t index;
+		int64_t begin;
+		size_t size;
+		SharedBuffer buffer;		// Read only, see postPieceRead()
+		const uint8_t *block;
+	};
+
+	void postCompletion(DiskCompletion &&c);
+	void drainCompletions();
 	void onPieceWriteComplete(uint32_t from, size_t index);
-	void onPieceReadComplete(uint32_t from, size_t index, int64_t begin, uint8_t *block, size_t size);
+	void onPieceHashFailed(uint32_t from, size_t index, size_t size);
+	void onPieceReadComplete(uint32_t from, size_t index, int64_t begin, const SharedBuffer &buffer, const uint8_t *block, size_t size);
 
 private:
+	// Peers of a torrent can be on different network threads, this covers
+	// everything peers and the torrent share: the peer list, the block
+	// table and the peers themselves.  The counters are readable without it.
+	mutable std::recursive_mutex m_mutex;
+
 	Server *m_listener;
+	asio::deadline_timer m_announceTimer;
+	asio::deadline_timer m_rateTimer;
+	asio::deadline_timer m_chokeTimer;
+	size_t m_maxPeers;
 	TorrentMeta m_meta;
+	// Declared before the file manager, which may still complete on its way out
+	MPSCQueue<DiskCompletion> m_completions;
+	std::atomic<bool> m_drainPosted;	// a drainCompletions() is on its way
 	TorrentFileManager m_fileManager;
+	BlockTable m_blocks;
+	Choker m_choker;
 
 	std::vector<Tracker *> m_activeTrackers;
 	std::unordered_map<uint32_t, PeerPtr> m_peers;
 	std::unordered_set<uint32_t> m_blacklisted;
+	std::unordered_map<size_t, std::vector<uint32_t>> m_pieceSenders;	// pieces waiting on their hash
 
-	size_t m_uploadedBytes;
-	size_t m_downloadedBytes;
-	size_t m_wastedBytes;
-	size_t m_hashMisses;
+	RateMeter m_downloadMeter;
+	RateMeter m_uploadMeter;
+	RateLimiter m_uploadLimiter;
+	RateLimiter m_downloadLimiter;
+	bool m_limitLocal;
+	std::atomic<size_t> m_downloadedBytes;
+	std::atomic<size_t> m_wastedBytes;
+	std::atomic<size_t> m_hashMisses;
+	std::atomic<size_t> m_redundantBytes;	// duplicate blocks, end-game mostly
+
+	std::function<void()> m_finishedCallback;
+
+	size_t m_streamRate;
+	std::vector<uint64_t> m_readCursors;
 
-	clock_t m_startTime;
 	uint8_t m_handshake[68];
 	uint8_t m_peerId[20];
 
@@ -133,5 +233,8 @@ private:
 	friend class Tracker;
 };
 
+extern RateMeter g_downloadMeter;
+extern RateMeter g_uploadMeter;
+
 #endif
 
@@ -20,103 +20,215 @@
  * THE SOFTWARE.
  */
 #include "torrentfilemanager.h"
+#include "diskscheduler.h"
+#include "piecepicker.h"
+#include "resumedata.h"
 #include "torrent.h"
 
 #include <util/auxiliar.h>
+#include <util/iouring.h>
+#include <util/sha1.h>
+#include <util/workpool.h>
+#include <net/connection.h>
 
-#include <thread>
-#include <future>
 #include <mutex>
-#include <atomic>
+#include <memory>
+#include <chrono>
 #include <condition_variable>
 
 #include <deque>
-#include <queue>
 
-#include <boost/uuid/sha1.hpp>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/uio.h>
+#else
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#define fsync(fd)	_commit(fd)
+
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+// No positional I/O on Windows, emulate it (not thread safe.)
+static ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int r = read(fd, iov[i].iov_base, iov[i].iov_len);
+		if (r < 0)
+			return total ? total : -1;
+
+		total += r;
+		if ((size_t)r != iov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+
+static ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
+
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int r = write(fd, iov[i].iov_base, iov[i].iov_len);
+		if (r < 0)
+			return total ? total : -1;
+
+		total += r;
+		if ((size_t)r != iov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+#endif
 
 struct TorrentFile {
-	FILE *fp;
+	int fd;
+	uint8_t *map;		// nullptr unless mapped, see map_file()
 	TorrentFileInfo info;
 };
 
-struct ReadRequest {
-	size_t index;
-	uint32_t id;
-	uint32_t from;
+// Maps the torrent byte range [begin, end) to m_files[file], empty files have
+// no span.
+struct FileSpan {
 	size_t begin;
-	size_t size;
+	size_t end;
+	size_t file;
+
+	bool operator<(size_t offset) const { return end <= offset; }
 };
-struct LeastReadRequest {
-	bool operator() (const ReadRequest &lhs, const ReadRequest &rhs) const {
-		return lhs.id > rhs.id;
-	}
+
+// A single write, or a run of adjacent reads coalesced into one, of a batch.
+// See process_batch()
+struct DiskOp {
+	const WriteRequest *write;
+	const ReadRequest *reads;
+	size_t numReads;
+	size_t offset;
+	size_t size;
+	SharedBuffer buffer;		// null when block is in a file mapping
+	const uint8_t *block;
+	bool failed;
 };
 
-struct WriteRequest {
-	size_t index;
-	uint32_t from;
-	DataBuffer<uint8_t> data;
+struct DiskVec {
+	struct iovec iov;
+	DiskOp *op;
 };
 
 struct Piece {
 	Piece(uint32_t *sum) {
 		memcpy(&hash[0], &sum[0], sizeof(hash));
-		pri = 0;
 	}
 
-	int32_t pri;	// TODO Support more piece download strategies
 	uint32_t hash[5];
 };
 
-class TorrentFileManagerImpl {
+// Hashes what's already on disk for every torrent, see scan_range()
+static WorkPool hashPool;
+
+class TorrentFileManagerImpl : public DiskClient {
+	enum {
+		MaxCoalesce = 1 << 20,	// upper bound for merging adjacent reads
+		JournalInterval = 2	// seconds between resume journal flushes
+	};
+
 public:
 	TorrentFileManagerImpl(Torrent *t) {
 		m_torrent = t;
-		m_stopped = false;
-		m_thread = std::thread(std::bind(&TorrentFileManagerImpl::thread, this));
+		m_useRing = false;
+		m_completedBytes = 0;
+		m_diskQueue = g_diskScheduler.attach(this);
 	}
 
 	~TorrentFileManagerImpl() {
-		lock();
-		m_stopped = true;
-		unlock_and_notify();
-		m_thread.join();
+		g_diskScheduler.detach(m_diskQueue);
+		if (!m_files.empty())
+			save_resume();
+
+		for (TorrentFile &f : m_files) {
+			unmap_file(f);
+			close(f.fd);
+		}
 	}
 
 public:
 	void lock() { m_mutex.lock(); }
 	void unlock() { m_mutex.unlock(); }
-	void unlock_and_notify() { m_mutex.unlock(); m_condition.notify_all(); }
 
-	void push_read(const ReadRequest &r) { m_readRequests.push(r); }
-	void push_write(WriteRequest &&w) { m_writeRequests.push(std::move(w)); m_pendingBits.set(w.index); }
+	void push_read(const ReadRequest &r) { g_diskScheduler.pushRead(m_diskQueue, r); }
+	void push_write(WriteRequest &&w) {
+		m_pendingBits.set(w.index);
+		g_diskScheduler.pushWrite(m_diskQueue, std::move(w));
+	}
+	bool begin_verify(size_t index) {
+		if (m_completedBits.test(index) || !m_pendingBits.set(index))
+			return false;
+
+		// complete_write() marks it completed before it stops being pending
+		if (m_completedBits.test(index)) {
+			m_pendingBits.clear(index);
+			return false;
+		}
+		return true;
+	}
+	void complete_verify(WriteRequest &&w, bool success);
+	void cancel_read(uint32_t from, size_t index, size_t begin, size_t size) { g_diskScheduler.cancelRead(m_diskQueue, from, index, begin, size); }
+	void cancel_reads(uint32_t from) { g_diskScheduler.cancelReads(m_diskQueue, from); }
 	void push_file(const TorrentFile &f) { m_files.push_back(f); }
+	void build_spans();
 	void scan_file(const TorrentFile &f);
+	void scan_range(size_t first, size_t last);
 	void scan_pieces();
 
-	const bitset *completed_bits() const { return &m_completedBits; }
+	void load_resume(const std::string &path);
+	bool save_resume();
+	void journal_piece(size_t index);
+	void flush() override;
+
+	static bool map_file(TorrentFile &f);
+	static void unmap_file(TorrentFile &f);
+	static void sync_file(TorrentFile &f);
+	void use_ring() { m_useRing = true; g_diskScheduler.enableRing(); }
+
+	const atomic_bitset *completed_bits() const { return &m_completedBits; }
 	size_t pending() const { return m_pendingBits.count(); }
 	size_t completed_pieces() const { return m_completedBits.count(); }
 	size_t total_pieces() const { return m_pieces.size(); }
-	size_t get_next_piece(const std::function<bool (size_t)> &fun);
-	size_t compute_downloaded();
+	size_t get_next_piece(const bitset *pieces, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut);
+	void set_deadlines(const PieceDeadlines &deadlines) { lock(); m_picker.setDeadlines(deadlines); unlock(); }
+	void init_picker();
+	void add_availability(size_t index) { lock(); m_picker.incAvailability(index); unlock(); }
+	void remove_availability(const bitset *pieces);
+	void release_piece(size_t index) { lock(); m_picker.release(index); unlock(); }
+	void join_piece(size_t index) { lock(); m_picker.join(index); unlock(); }
+	size_t completed_bytes() const { return m_completedBytes; }
+	void mark_completed(size_t index) {
+		if (m_completedBits.set(index))
+			m_completedBytes += piece_length(index);
+	}
+	void mark_missing(size_t index) {
+		if (m_completedBits.clear(index))
+			m_completedBytes -= piece_length(index);
+	}
 
 	bool piece_done(size_t index) const { return index < m_pieces.size() && m_completedBits.test(index); }
 	bool piece_pending(size_t index) const { return index < m_pieces.size() && m_pendingBits.test(index); }
 	bool intact(size_t index) const { return index < m_pieces.size(); }
-	bool is_read_eligible(size_t index, int64_t end) const { return m_completedBits.test(index) && end < piece_length(index); }
-	bool is_write_eligible(size_t index, const uint8_t *data, size_t size) const {
-		if (m_pendingBits.test(index))
-			return false;
-
-		boost::uuids::detail::sha1 sha1;
-		sha1.process_bytes(data, size);
-
-		uint32_t digest[5];
-		sha1.get_digest(digest);
-
-		return memcmp(digest, m_pieces[index].hash, 5) == 0;
+	bool is_read_eligible(size_t index, int64_t end) const { return m_completedBits.test(index) && end <= piece_length(index); }
+	bool digest_matches(size_t index, const uint32_t *digest) const {
+		return memcmp(digest, m_pieces[index].hash, sizeof(m_pieces[index].hash)) == 0;
 	}
 
 	int64_t piece_length(size_t index) const {
@@ -145,190 +257,485 @@ public:
 			m_pieces.push_back(Piece(s));
 	}
 
-protected:
-	void thread();	
+	void processBatch(std::vector<WriteRequest> &writes, std::vector<ReadRequest> &reads, IoUring *ring) override;
 
-	bool process_read(const ReadRequest &r);
+protected:
+	bool process_read(DiskOp &op);
 	bool process_write(const WriteRequest &w);
+	void process_batch(std::vector<DiskOp> &ops, IoUring *ring);
+	void complete_reads(const DiskOp &op);
+	void complete_write(const WriteRequest &w, bool success);
 
-private:
-	std::priority_queue<ReadRequest, std::deque<ReadRequest>, LeastReadRequest> m_readRequests;
-	std::queue<WriteRequest> m_writeRequests;
+	const uint8_t *mapped_range(size_t offset, size_t size) const;
+	bool read_range(size_t offset, uint8_t *buf, size_t size);
+	bool block_file(size_t index, size_t begin, size_t size, int &fd, uint64_t &offset) const;
+	bool write_range(size_t offset, const uint8_t *buf, size_t size);
+	bool transfer(size_t offset, const struct iovec *iov, size_t iovcnt, bool write);
 
-	bitset m_completedBits;
-	bitset m_pendingBits;
+private:
+	// Checked without m_mutex, the picker still needs it
+	atomic_bitset m_completedBits;
+	atomic_bitset m_pendingBits;
+	std::atomic<size_t> m_completedBytes;	// sum of the completed pieces' lengths
+	PiecePicker m_picker;
 
 	std::vector<TorrentFile> m_files;
+	std::vector<FileSpan> m_spans;
 	std::vector<Piece> m_pieces;
 
-	std::thread m_thread;
 	std::mutex m_mutex;
-	std::condition_variable m_condition;
-	std::atomic_bool m_stopped;
+	DiskScheduler::Queue *m_diskQueue;
+	bool m_useRing;
+
+	ResumeData m_resume;
+	std::vector<bool> m_dirty;	// files written since the last journal flush
+	std::chrono::steady_clock::time_point m_lastFlush;
 
 	Torrent *m_torrent;
 	friend class TorrentFileManager;
 };
 
-void TorrentFileManagerImpl::scan_file(const TorrentFile &f)
+void TorrentFileManagerImpl::build_spans()
 {
-	FILE *fp = f.fp;
-	fseek(fp, 0L, SEEK_END);
-	size_t fileLength = ftello(fp);
-	fseek(fp, 0L, SEEK_SET);
+	m_spans.clear();
+	m_spans.reserve(m_files.size());
 
-	if (f.info.length > fileLength) {
-//		truncate(f.info.path.c_str(), f.info.length);
-		return;
+	for (size_t i = 0; i < m_files.size(); ++i) {
+		const TorrentFileInfo &inf = m_files[i].info;
+		if (inf.length == 0)
+			continue;
+
+		FileSpan span;
+		span.begin = inf.begin;
+		span.end = inf.begin + inf.length;
+		span.file = i;
+		m_spans.push_back(span);
 	}
 
-	size_t m_pieceLength = m_torrent->meta()->pieceLength();
-	size_t pieceIndex = 0;
-	if (f.info.begin > 0)
-		pieceIndex = f.info.begin / m_pieceLength;
+	std::sort(m_spans.begin(), m_spans.end(),
+		  [] (const FileSpan &lhs, const FileSpan &rhs) { return lhs.begin < rhs.begin; });
+}
 
-	size_t pieceBegin = pieceIndex * m_pieceLength;
-	size_t pieceLength = piece_length(pieceIndex);
-	size_t fileEnd = f.info.begin + f.info.length;
-	if (pieceBegin + pieceLength > fileEnd)
+void TorrentFileManagerImpl::scan_file(const TorrentFile &f)
+{
+	if (f.info.length == 0)
 		return;
 
-	uint8_t buf[m_pieceLength];
-	if (pieceBegin < f.info.begin) {
-		size_t bufPos = f.info.begin - pieceBegin;
-		if (fread(&buf[bufPos], 1, m_pieceLength - bufPos, fp) != m_pieceLength - bufPos)
-			return;
-
-		size_t index = f.info.index;
-		while (bufPos != 0) {
-			TorrentFile *cf = &m_files[--index];
-			FILE *fpp = cf->fp;
+	size_t pieceLength = m_torrent->meta()->pieceLength();
+	size_t first = f.info.begin / pieceLength;
+	size_t last = (f.info.begin + f.info.length - 1) / pieceLength;
+	scan_range(first, std::min(last, m_pieces.size() - 1));
+}
 
-			if (bufPos > cf->info.length) {
-				if (fread(&buf[bufPos - cf->info.length], 1, bufPos, fpp) != cf->info.length)
-					return;
+void TorrentFileManagerImpl::scan_range(size_t first, size_t last)
+{
+	size_t pieceLength = m_torrent->meta()->pieceLength();
 
-				bufPos -= cf->info.length;
-			} else {
-				fseek(fpp, cf->info.length - bufPos, SEEK_SET);
-				if (fread(&buf[0], 1, bufPos, fpp) != bufPos)
-					return;
+	// Each hash thread reads a group of pieces at a time and hashes them
+	// side by side when there's a multi-buffer engine, within reason for
+	// huge pieces.
+	size_t lanes = std::max<size_t>(1, std::min<size_t>(Sha1::lanes(), (64 << 20) / pieceLength));
+	size_t groups = (last - first) / lanes + 1;
+
+	if (hashPool.workers() == 0)
+		hashPool.setWorkers(0);
+
+	std::atomic<size_t> next(0);
+	std::mutex mutex;
+	std::condition_variable finished;
+	size_t running = std::min(hashPool.workers(), groups);
+
+	auto scan = [&] () {
+		DataBuffer<uint8_t> buf(lanes * pieceLength);
+		std::vector<const uint8_t *> data(lanes);
+		std::vector<size_t> sizes(lanes);
+		std::vector<size_t> indices(lanes);
+		std::unique_ptr<uint32_t[][5]> digests(new uint32_t[lanes][5]);
+
+		for (size_t g = next++; g < groups; g = next++) {
+			size_t count = 0;
+			for (size_t i = first + g * lanes; i <= last && i < first + (g + 1) * lanes; ++i) {
+				uint8_t *p = &buf[count * pieceLength];
+				size_t length = piece_length(i);
+				if (!read_range(i * pieceLength, p, length))
+					continue;
+
+				data[count] = p;
+				sizes[count] = length;
+				indices[count] = i;
+				++count;
+			}
 
-				break;
+			Sha1::hashMany(data.data(), sizes.data(), count, digests.get());
+			for (size_t k = 0; k < count; ++k) {
+				if (memcmp(digests[k], m_pieces[indices[k]].hash, sizeof(digests[k])) == 0)
+					mark_completed(indices[k]);
 			}
 		}
 
-		if (is_write_eligible(pieceIndex, &buf[0], m_pieceLength))
-			m_completedBits.set(pieceIndex);
+		std::lock_guard<std::mutex> guard(mutex);
+		if (--running == 0)
+			finished.notify_one();
+	};
+
+	std::unique_lock<std::mutex> guard(mutex);
+	for (size_t i = running; i > 0; --i)
+		hashPool.push(scan);
+	finished.wait(guard, [&running] () { return running == 0; });
+}
 
-		pieceBegin += pieceLength;
-		++pieceIndex;
+void TorrentFileManagerImpl::scan_pieces()
+{
+	if (!m_pieces.empty())
+		scan_range(0, m_pieces.size() - 1);
+}
+
+// Only pieces of files that changed behind our back since the resume data was
+// written need to be hashed again, everything else is trusted.
+void TorrentFileManagerImpl::load_resume(const std::string &path)
+{
+	m_resume.setPath(path, m_torrent->meta()->checkSum());
+
+	std::vector<ResumeFileState> states(m_files.size());
+	bitset completed(m_pieces.size());
+	if (!m_resume.load(completed, states)) {
+		scan_pieces();
+		return;
 	}
 
-	fseek(fp, pieceBegin - f.info.begin, SEEK_SET);
-	size_t real = pieceIndex;
-	bool escape = false;
-#pragma omp parallel for
-	for (size_t i = pieceIndex; i < m_pieces.size() - 1; ++i) {
-		if (escape)
-			continue;
+	m_completedBits.assign(completed);
+	for (size_t i = 0; i < m_pieces.size(); ++i)
+		if (completed.test(i))
+			m_completedBytes += piece_length(i);
 
-		if (pieceBegin + m_pieceLength >= fileEnd) {
-#pragma omp critical
-			escape = true;
-			real = i;
+	size_t pieceLength = m_torrent->meta()->pieceLength();
+	std::vector<size_t> changed;
+	for (size_t i = 0; i < m_files.size(); ++i) {
+		const TorrentFile &f = m_files[i];
+		if (f.info.length == 0)
 			continue;
-		}
 
-		fread(&buf[0], 1, m_pieceLength, fp);
-		if (is_write_eligible(i, &buf[0], m_pieceLength))
-			m_completedBits.set(i);
+		ResumeFileState state;
+		if (ResumeFileState::fromFd(f.fd, state) && state == states[i])
+			continue;
 
-		pieceBegin += m_pieceLength;
+		size_t last = std::min((f.info.begin + f.info.length - 1) / pieceLength, m_pieces.size() - 1);
+		for (size_t p = f.info.begin / pieceLength; p <= last; ++p)
+			mark_missing(p);
+		changed.push_back(i);
 	}
 
-	pieceIndex = real;
-	if (pieceIndex == total_pieces() - 1) {
-		pieceLength = last_piece_length();
-		fread(&buf[0], 1, pieceLength, fp);
-		if (is_write_eligible(pieceIndex, &buf[0], pieceLength))
-			m_completedBits.set(pieceIndex);
+	for (size_t i : changed)
+		scan_file(m_files[i]);
+}
+
+bool TorrentFileManagerImpl::save_resume()
+{
+	std::vector<ResumeFileState> states(m_files.size());
+	for (size_t i = 0; i < m_files.size(); ++i) {
+		TorrentFile &f = m_files[i];
+		sync_file(f);
+		if (!ResumeFileState::fromFd(f.fd, states[i]))
+			return false;
 	}
+
+	bitset completed;
+	m_completedBits.copy(completed);
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	std::fill(m_dirty.begin(), m_dirty.end(), false);
+	return m_resume.save(completed, states);
 }
 
-void TorrentFileManagerImpl::scan_pieces()
+void TorrentFileManagerImpl::journal_piece(size_t index)
 {
-	for (const TorrentFile &f : m_files)
-		scan_file(f);
+	size_t offset = index * m_torrent->meta()->pieceLength();
+	size_t end = offset + piece_length(index);
+
+	std::vector<std::pair<size_t, ResumeFileState>> states;
+	lock();
+	for (auto span = std::lower_bound(m_spans.begin(), m_spans.end(), offset);
+	     span != m_spans.end() && span->begin < end; ++span) {
+		ResumeFileState state;
+		if (!ResumeFileState::fromFd(m_files[span->file].fd, state))
+			continue;
+
+		// Marked before the record is queued, see flush()
+		m_dirty[span->file] = true;
+		states.push_back(std::make_pair(span->file, state));
+	}
+	unlock();
+
+	m_resume.journal(index, states);
 }
 
-void TorrentFileManagerImpl::thread()
+void TorrentFileManagerImpl::flush()
 {
-	std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+	m_resume.flush([this] () {
+		lock();
+		std::vector<bool> dirty(m_files.size(), false);
+		dirty.swap(m_dirty);
+		m_lastFlush = std::chrono::steady_clock::now();
+		unlock();
+
+		for (size_t i = 0; i < dirty.size(); ++i)
+			if (dirty[i])
+				sync_file(m_files[i]);
+	});
+}
 
-	while (!m_stopped) {
-		lock.lock();
-		if (m_writeRequests.empty() && m_readRequests.empty())
-			m_condition.wait(lock);	
+void TorrentFileManagerImpl::complete_verify(WriteRequest &&w, bool success)
+{
+	if (success) {
+		push_write(std::move(w));
+		return;
+	}
 
-		// It doesn't really matter which one we process first
-		// as torrent should be aware of our write process and should not
-		// mark the piece as fully have before we fully wrote it to disk.
-		while (!m_writeRequests.empty() && !m_stopped) {
-			const WriteRequest &w = m_writeRequests.front();
-			if (!process_write(w))
-				break;
+	m_pendingBits.clear(w.index);
+	m_torrent->postPieceHashFailed(w.from, w.index, w.data.size());
+}
 
-			m_writeRequests.pop();
-		}
+void TorrentFileManagerImpl::processBatch(std::vector<WriteRequest> &writes, std::vector<ReadRequest> &reads, IoUring *ring)
+{
+	std::vector<DiskOp> ops;
+	ops.reserve(writes.size() + reads.size());
+
+	// It doesn't really matter which one we process first
+	// as torrent should be aware of our write process and should not
+	// mark the piece as fully have before we fully wrote it to disk.
+	for (const WriteRequest &w : writes) {
+		DiskOp op;
+		op.write = &w;
+		op.reads = nullptr;
+		op.numReads = 0;
+		op.offset = w.index * m_torrent->meta()->pieceLength();
+		op.size = w.data.size();
+		op.block = nullptr;
+		op.failed = false;
+		ops.push_back(std::move(op));
+	}
 
-		while (!m_readRequests.empty() && !m_stopped) {
-			ReadRequest r = m_readRequests.top();
-			if (!process_read(r))
+	// Reads come in sorted, merge the ones that are back to back so they
+	// go to disk as a single larger read.
+	for (size_t i = 0; i < reads.size(); ) {
+		DiskOp op;
+		op.write = nullptr;
+		op.reads = &reads[i];
+		op.numReads = 1;
+		op.offset = reads[i].offset;
+		op.size = reads[i].size;
+		op.block = nullptr;
+		op.failed = false;
+
+		for (++i; i < reads.size(); ++i) {
+			const ReadRequest &r = reads[i];
+			if (r.offset != op.offset + op.size || op.size + r.size > MaxCoalesce)
 				break;
 
-			m_readRequests.pop();	
+			op.size += r.size;
+			++op.numReads;
 		}
 
-		if (m_stopped)
-			break;
+		ops.push_back(std::move(op));
+	}
 
-		lock.unlock();
+	if (ring && m_useRing) {
+		process_batch(ops, ring);
+		return;
+	}
+
+	for (DiskOp &op : ops) {
+		if (op.write)
+			process_write(*op.write);
+		else
+			process_read(op);
 	}
 }
 
-bool TorrentFileManagerImpl::process_read(const ReadRequest &r)
+bool TorrentFileManagerImpl::map_file(TorrentFile &f)
 {
-	const TorrentMeta *meta = m_torrent->meta();
-	int64_t blockBegin = r.begin + r.index * meta->pieceLength();
-	int64_t blockEnd = r.begin + r.size;
-	uint8_t *block = new uint8_t[r.size];
-
-	size_t writePos = 0;
-	for (const TorrentFile &f : m_files) {
-		const TorrentFileInfo &i = f.info;
-		size_t filePos = blockBegin + writePos;
-		if (filePos < i.begin)
+#ifndef _WIN32
+	if (f.info.length == 0)
+		return false;
+
+	// The mapping has to cover the whole file, so make sure it's there on disk
+	// (sparse where the filesystem supports it.)
+	struct stat st;
+	if (fstat(f.fd, &st) != 0)
+		return false;
+
+	if ((size_t)st.st_size < f.info.length && ftruncate(f.fd, f.info.length) != 0)
+		return false;
+
+	void *map = mmap(nullptr, f.info.length, PROT_READ | PROT_WRITE, MAP_SHARED, f.fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+	f.map = (uint8_t *)map;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void TorrentFileManagerImpl::unmap_file(TorrentFile &f)
+{
+#ifndef _WIN32
+	if (f.map)
+		munmap(f.map, f.info.length);
+#endif
+	f.map = nullptr;
+}
+
+void TorrentFileManagerImpl::sync_file(TorrentFile &f)
+{
+#ifndef _WIN32
+	if (f.map)
+		msync(f.map, f.info.length, MS_SYNC);
+#endif
+#ifdef __linux__
+	fdatasync(f.fd);
+#else
+	fsync(f.fd);
+#endif
+}
+
+const uint8_t *TorrentFileManagerImpl::mapped_range(size_t offset, size_t size) const
+{
+	auto span = std::lower_bound(m_spans.begin(), m_spans.end(), offset);
+	if (span == m_spans.end() || offset < span->begin || offset + size > span->end)
+		return nullptr;
+
+	const TorrentFile &f = m_files[span->file];
+	if (!f.map)
+		return nullptr;
+
+	return f.map + (offset - span->begin);
+}
+
+bool TorrentFileManagerImpl::block_file(size_t index, size_t begin, size_t size, int &fd, uint64_t &offset) const
+{
+	if (!intact(index) || !is_read_eligible(index, begin + size))
+		return false;
+
+	size_t pos = index * m_torrent->meta()->pieceLength() + begin;
+	auto span = std::lower_bound(m_spans.begin(), m_spans.end(), pos);
+	if (span == m_spans.end() || pos < span->begin || pos + size > span->end)
+		return false;
+
+	fd = m_files[span->file].fd;
+	offset = pos - span->begin;
+	return fd >= 0;
+}
+
+bool TorrentFileManagerImpl::read_range(size_t offset, uint8_t *buf, size_t size)
+{
+	struct iovec iov = { buf, size };
+	return transfer(offset, &iov, 1, false);
+}
+
+bool TorrentFileManagerImpl::write_range(size_t offset, const uint8_t *buf, size_t size)
+{
+	struct iovec iov = { const_cast<uint8_t *>(buf), size };
+	return transfer(offset, &iov, 1, true);
+}
+
+// Move the data described by iov to/from the torrent at offset, issuing one
+// preadv()/pwritev() (or memcpy() for mapped files) per file it covers.
+bool TorrentFileManagerImpl::transfer(size_t offset, const struct iovec *iov, size_t iovcnt, bool write)
+{
+	enum { MaxVecs = 64 };
+
+	size_t vec = 0;		// current iovec
+	size_t vecPos = 0;	// offset into it
+	size_t remaining = 0;
+	for (size_t i = 0; i < iovcnt; ++i)
+		remaining += iov[i].iov_len;
+
+	auto span = std::lower_bound(m_spans.begin(), m_spans.end(), offset);
+	while (remaining > 0) {
+		if (span == m_spans.end() || offset < span->begin)
 			return false;
 
-		size_t fileEnd = i.begin + i.length;
-		if (filePos > fileEnd)
-			continue;
-		fseek(f.fp, filePos - i.begin, SEEK_SET);
+		const TorrentFile &f = m_files[span->file];
+		size_t amount = std::min(span->end - offset, remaining);
+		size_t filePos = offset - span->begin;
+
+		offset += amount;
+		remaining -= amount;
+		while (amount > 0) {
+			struct iovec vecs[MaxVecs];
+			size_t count = 0;
+			size_t bytes = 0;
+
+			// Gather the part of the caller's iovecs that falls in this file
+			size_t v = vec, p = vecPos;
+			while (count < MaxVecs && bytes < amount) {
+				size_t len = std::min(iov[v].iov_len - p, amount - bytes);
+				vecs[count].iov_base = (uint8_t *)iov[v].iov_base + p;
+				vecs[count].iov_len = len;
+				++count;
+				bytes += len;
+				if (p + len == iov[v].iov_len) {
+					++v;
+					p = 0;
+				} else
+					p += len;
+			}
 
-		size_t readSize = std::max(fileEnd - filePos, r.size - writePos);
-		size_t maxRead = writePos + readSize;
-		while (writePos < maxRead) {
-			int read = fread(&block[writePos], 1, readSize - writePos, f.fp);
-			if (read <= 0)
+			ssize_t done;
+			if (f.map) {
+				uint8_t *fileData = f.map + filePos;
+				for (size_t i = 0; i < count; ++i) {
+					if (write)
+						memcpy(fileData, vecs[i].iov_base, vecs[i].iov_len);
+					else
+						memcpy(vecs[i].iov_base, fileData, vecs[i].iov_len);
+					fileData += vecs[i].iov_len;
+				}
+
+				done = bytes;
+			} else if (write)
+				done = pwritev(f.fd, vecs, count, filePos);
+			else
+				done = preadv(f.fd, vecs, count, filePos);
+
+			if (done <= 0)
 				return false;
 
-			writePos += read;
+			// Advance past what was actually transferred (might be short)
+			filePos += done;
+			amount -= done;
+			while (done > 0) {
+				size_t len = std::min<size_t>(iov[vec].iov_len - vecPos, done);
+				done -= len;
+				vecPos += len;
+				if (vecPos == iov[vec].iov_len) {
+					++vec;
+					vecPos = 0;
+				}
+			}
 		}
+
+		++span;
 	}
 
-	std::async(std::launch::async,
-		   std::bind(&Torrent::onPieceReadComplete, m_torrent, r.from, r.index, r.begin, block, r.size));
+	return true;
+}
+
+bool TorrentFileManagerImpl::process_read(DiskOp &op)
+{
+	// Serve straight out of the mapping when the whole run lives in one
+	// mapped file, otherwise gather it into a temporary buffer.
+	if (!op.block && !(op.block = mapped_range(op.offset, op.size))) {
+		op.buffer = std::make_shared<DataBuffer<uint8_t>>(op.size);
+		if (!read_range(op.offset, op.buffer->data(), op.size))
+			return false;
+
+		op.block = op.buffer->data();
+	}
+
+	complete_reads(op);
 	return true;
 }
 
@@ -337,82 +744,162 @@ bool TorrentFileManagerImpl::process_write(const WriteRequest &w)
 	const TorrentMeta *meta = m_torrent->meta();
 	size_t beginPos = w.index * meta->pieceLength();
 
-	const uint8_t *buf = &w.data[0];
-	size_t length = w.data.size();
-	size_t off = 0;
+	bool success = write_range(beginPos, &w.data[0], w.data.size());
+	complete_write(w, success);
+	return success;
+}
 
-	for (const TorrentFile &f : m_files) {
-		const TorrentFileInfo &i = f.info;
-		if (beginPos < i.begin)
-			break;
+// Push a whole batch through io_uring: one SQE per file each op covers,
+// everything submitted with a single syscall and reaped in bulk.  Anything
+// that comes back short or failed is retried through the blocking path.
+void TorrentFileManagerImpl::process_batch(std::vector<DiskOp> &ops, IoUring *ring)
+{
+	std::deque<DiskVec> vecs;	// stable addresses, the kernel holds on to them
 
-		size_t fileEnd = i.begin + i.length;
-		if (beginPos >= fileEnd)
-			continue;
+	auto reap = [&] () {
+		uint64_t userData;
+		int res;
 
-		size_t amount = fileEnd - beginPos;
-		if (amount > length)
-			amount = length;
+		while (ring->peek(userData, res)) {
+			DiskVec *v = (DiskVec *)(uintptr_t)userData;
+			if (res < 0 || (size_t)res != v->iov.iov_len)
+				v->op->failed = true;
+		}
+	};
 
-		fseek(f.fp, beginPos - i.begin, SEEK_SET);
-		size_t wrote = fwrite(buf + off, 1, amount, f.fp);
-		off += wrote;
-		beginPos += wrote;
-		length -= wrote;
-	}
+	auto queue = [&] (DiskOp *op, uint8_t *buf, bool write) {
+		size_t offset = op->offset;
+		size_t size = op->size;
 
-	m_pendingBits.clear(w.index);
-	m_completedBits.set(w.index);
-	std::async(std::launch::async,
-		   std::bind(&Torrent::onPieceWriteComplete, m_torrent, w.from, w.index));
-	return true;
-}
+		auto span = std::lower_bound(m_spans.begin(), m_spans.end(), offset);
+		while (size > 0) {
+			if (span == m_spans.end() || offset < span->begin) {
+				op->failed = true;
+				return;
+			}
 
-size_t TorrentFileManagerImpl::get_next_piece(const std::function<bool (size_t)> &fun)
-{
-	size_t index = 0;
-	int32_t priority = std::numeric_limits<int32_t>::max();
+			const TorrentFile &f = m_files[span->file];
+			size_t amount = std::min(span->end - offset, size);
+			size_t filePos = offset - span->begin;
+			if (f.map) {
+				if (write)
+					memcpy(f.map + filePos, buf, amount);
+				else
+					memcpy(buf, f.map + filePos, amount);
+			} else {
+				DiskVec v = { { buf, amount }, op };
+				vecs.push_back(v);
+
+				uint64_t userData = (uintptr_t)&vecs.back();
+				while (!(write ? ring->prepareWritev(f.fd, &vecs.back().iov, 1, filePos, userData)
+					       : ring->prepareReadv(f.fd, &vecs.back().iov, 1, filePos, userData))) {
+					// Ring is full, wait for some of it to drain
+					if (!ring->submit(ring->inflight() ? 1 : 0)) {
+						op->failed = true;
+						return;
+					}
+					reap();
+				}
+			}
 
-	std::lock_guard<std::mutex> guard(m_mutex);
-	for (size_t i = 0; i < m_pieces.size(); ++i) {
-		Piece *p = &m_pieces[i];
-		if (m_completedBits.test(i) || m_pendingBits.test(i) || !fun(i))
-			continue;
+			buf += amount;
+			offset += amount;
+			size -= amount;
+			++span;
+		}
+	};
 
-		if (!p->pri) {
-			p->pri = 1;
-			return i;
+	for (DiskOp &op : ops) {
+		if (op.write) {
+			queue(&op, const_cast<uint8_t *>(&op.write->data[0]), true);
+		} else if (!(op.block = mapped_range(op.offset, op.size))) {
+			op.buffer = std::make_shared<DataBuffer<uint8_t>>(op.size);
+			op.block = op.buffer->data();
+			queue(&op, op.buffer->data(), false);
 		}
+	}
 
-		if (priority > p->pri) {
-			priority = p->pri;
-			index = i;
+	// Submit whatever is left and wait for all of it to complete
+	while (ring->queued() > 0 || ring->inflight() > 0) {
+		if (!ring->submit(1)) {
+			for (DiskOp &op : ops)
+				op.failed = true;
+			break;
 		}
+
+		reap();
 	}
 
-	if (priority != std::numeric_limits<int32_t>::max()) {
-		++m_pieces[index].pri;
-		return index;
+	for (DiskOp &op : ops) {
+		if (op.write) {
+			if (op.failed)
+				process_write(*op.write);
+			else
+				complete_write(*op.write, true);
+		} else if (op.failed) {
+			// Whatever made it into the buffer can't be trusted, read it
+			// all again
+			op.block = nullptr;
+			op.buffer.reset();
+			process_read(op);
+		} else
+			complete_reads(op);
 	}
+}
+
+void TorrentFileManagerImpl::complete_reads(const DiskOp &op)
+{
+	for (size_t i = 0; i < op.numReads; ++i) {
+		const ReadRequest &r = op.reads[i];
+		const uint8_t *block = op.block + (r.offset - op.offset);
 
-	return std::numeric_limits<size_t>::max();
+		m_torrent->postPieceRead(r.from, r.index, r.begin, op.buffer, block, r.size);
+	}
 }
 
-size_t TorrentFileManagerImpl::compute_downloaded()
+void TorrentFileManagerImpl::complete_write(const WriteRequest &w, bool success)
 {
-	size_t i = 0;
-	size_t downloaded = 0;
-	size_t pieceLength = m_torrent->meta()->pieceLength();
+	// Completed before it stops being pending, see begin_verify()
+	if (success)
+		mark_completed(w.index);
+	m_pendingBits.clear(w.index);
 
+	lock();
+	if (success)
+		m_picker.have(w.index);
+	bool due = std::chrono::steady_clock::now() - m_lastFlush >= std::chrono::seconds(JournalInterval);
+	unlock();
+
+	if (!success)
+		return;
+
+	journal_piece(w.index);
+	if (due)
+		flush();
+
+	m_torrent->postPieceWritten(w.from, w.index);
+}
+
+size_t TorrentFileManagerImpl::get_next_piece(const bitset *pieces, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut)
+{
 	std::lock_guard<std::mutex> guard(m_mutex);
-	for (; i < m_pieces.size() - 1; ++i)
-		if (m_completedBits.test(i))
-			downloaded += pieceLength;
+	return m_picker.pick(*pieces, m_pendingBits, downloading, fast, blocksOut);
+}
 
-	if (m_completedBits.test(i + 1))
-		downloaded += last_piece_length();
+void TorrentFileManagerImpl::init_picker()
+{
+	m_picker.init(m_pieces.size());
+	for (size_t i = 0; i < m_pieces.size(); ++i)
+		if (m_completedBits.test(i))
+			m_picker.have(i);
+}
 
-	return downloaded;
+void TorrentFileManagerImpl::remove_availability(const bitset *pieces)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	for (size_t i = 0; i < m_pieces.size(); ++i)
+		if (pieces->test(i))
+			m_picker.decAvailability(i);
 }
 
 TorrentFileManager::TorrentFileManager(Torrent *torrent)
@@ -425,7 +912,7 @@ TorrentFileManager::~TorrentFileManager()
 	delete i;
 }
 
-const bitset *TorrentFileManager::completedBits() const
+const atomic_bitset *TorrentFileManager::completedBits() const
 {
 	return i->completed_bits();
 }
@@ -445,14 +932,39 @@ size_t TorrentFileManager::totalPieces() const
 	return i->total_pieces();
 }
 
-size_t TorrentFileManager::getPieceforRequest(const std::function<bool (size_t)> &fun)
+size_t TorrentFileManager::getPieceforRequest(const bitset *pieces, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut)
+{
+	return i->get_next_piece(pieces, downloading, fast, blocksOut);
+}
+
+void TorrentFileManager::setPieceDeadlines(const PieceDeadlines &deadlines)
+{
+	i->set_deadlines(deadlines);
+}
+
+void TorrentFileManager::addAvailability(size_t index)
+{
+	i->add_availability(index);
+}
+
+void TorrentFileManager::removeAvailability(const bitset *pieces)
 {
-	return i->get_next_piece(fun);
+	i->remove_availability(pieces);
 }
 
-size_t TorrentFileManager::computeDownloaded()
+void TorrentFileManager::releasePiece(size_t index)
 {
-	return i->compute_downloaded();
+	i->release_piece(index);
+}
+
+void TorrentFileManager::joinPiece(size_t index)
+{
+	i->join_piece(index);
+}
+
+size_t TorrentFileManager::completedBytes() const
+{
+	return i->completed_bytes();
 }
 
 size_t TorrentFileManager::pending() const
@@ -470,7 +982,7 @@ bool TorrentFileManager::piecePending(size_t index) const
 	return i->piece_pending(index);
 }
 
-bool TorrentFileManager::registerFiles(const std::string &baseDir, const TorrentFiles &files)
+bool TorrentFileManager::registerFiles(const std::string &baseDir, const TorrentFiles &files, StorageMode mode)
 {
 	// We have to initialize pieces here
 	i->init_pieces();
@@ -491,54 +1003,85 @@ bool TorrentFileManager::registerFiles(const std::string &baseDir, const Torrent
 				MKDIR(path);
 		}
 
-		if (!nodeExists(fullPath)) {
-			// touch
-			FILE *fp = fopen(fullPath.c_str(), "wb");
-			if (!fp)
-				return false;
-
-			fclose(fp);
-		}
-
-		// Open for read and write
-		FILE *fp = fopen(fullPath.c_str(), "rb+");
-		if (!fp)
+		// Open for read and write, create if it doesn't exist yet
+#ifdef _WIN32
+		int fd = open(fullPath.c_str(), O_RDWR | O_CREAT | O_BINARY, 0644);
+#else
+		int fd = open(fullPath.c_str(), O_RDWR | O_CREAT, 0644);
+#endif
+		if (fd < 0)
 			return false;
 
-		TorrentFile f = {
-			.fp = fp,
-			.info = inf
-		};
+		TorrentFile f;
+		f.fd = fd;
+		f.map = nullptr;
+		f.info = inf;
+
+		// Files that cannot be mapped (e.g. empty ones) just use positional I/O.
+		if (mode == StorageMode::Mapped)
+			TorrentFileManagerImpl::map_file(f);
 		i->push_file(f);
 	}
 
-	i->scan_pieces();
+	i->build_spans();
+	i->m_dirty.assign(files.size(), false);
+
+	// Keep the resume data next to the files, named after the info hash so
+	// torrents sharing a download directory don't step on each other.
+	char hash[41];
+	const uint32_t *checkSum = i->m_torrent->meta()->checkSum();
+	for (size_t k = 0; k < 5; ++k)
+		sprintf(&hash[k * 8], "%08x", checkSum[k]);
+
+	i->load_resume(baseDir + "." + hash + ".resume");
+	i->save_resume();
+	i->init_picker();
+
+	// Blocking I/O it is, if the kernel lacks io_uring
+	if (mode == StorageMode::Uring)
+		i->use_ring();
 	return true;
 }
 
 bool TorrentFileManager::requestPieceBlock(size_t index, uint32_t from, size_t begin, size_t size)
 {
-	static uint32_t rid = 0;
 	if (!i->intact(index) || !i->is_read_eligible(index, begin + size))
 		return false;
 
-	ReadRequest r = {
-		.index = index,
-		.id = rid++,
-		.from = from,
-		.begin = begin,
-		.size = size
-	};
+	ReadRequest r;
+	r.index = index;
+	r.from = from;
+	r.begin = begin;
+	r.size = size;
+	r.offset = index * i->m_torrent->meta()->pieceLength() + begin;
 
-	i->lock();
 	i->push_read(r);
-	i->unlock_and_notify();
 	return true;
 }
 
-bool TorrentFileManager::writePieceBlock(size_t index, uint32_t from, DataBuffer<uint8_t> &&data)
+bool TorrentFileManager::blockFile(size_t index, size_t begin, size_t size, int &fd, uint64_t &offset) const
 {
-	if (!i->intact(index) || !i->is_write_eligible(index, &data[0], data.size()))
+	return i->block_file(index, begin, size, fd, offset);
+}
+
+void TorrentFileManager::cancelPieceBlock(size_t index, uint32_t from, size_t begin, size_t size)
+{
+	i->cancel_read(from, index, begin, size);
+}
+
+void TorrentFileManager::cancelRequests(uint32_t from)
+{
+	i->cancel_reads(from);
+}
+
+void TorrentFileManager::setDiskThreads(size_t count)
+{
+	g_diskScheduler.setWorkers(count);
+}
+
+bool TorrentFileManager::writePieceBlock(size_t index, uint32_t from, DataBuffer<uint8_t> &&data, const uint32_t *digest)
+{
+	if (!i->intact(index) || !i->begin_verify(index))
 		return false;
 
 	WriteRequest w;
@@ -546,9 +1089,11 @@ bool TorrentFileManager::writePieceBlock(size_t index, uint32_t from, DataBuffer
 	w.from = from;
 	w.data = std::move(data);
 
-	i->lock();
-	i->push_write(std::move(w));
-	i->unlock_and_notify();
+	i->complete_verify(std::move(w), i->digest_matches(index, digest));
 	return true;
 }
 
+void TorrentFileManager::setHashThreads(size_t count)
+{
+	hashPool.setWorkers(count);
+}
@@ -27,6 +27,7 @@
 
 #include <string>
 #include <vector>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 
@@ -37,6 +38,13 @@ struct TorrentFileInfo {
 	size_t length;
 };
 typedef std::vector<TorrentFileInfo> TorrentFiles;
+typedef std::vector<std::pair<size_t, std::chrono::steady_clock::time_point>> PieceDeadlines;
+
+enum class StorageMode {
+	Buffered,	// preadv()/pwritev() on the file descriptors
+	Mapped,		// mmap() each file and memcpy in and out of the page cache
+	Uring		// batched asynchronous I/O through io_uring, if the kernel has it
+};
 
 class Torrent;
 class TorrentFileManagerImpl;
@@ -45,19 +53,45 @@ public:
 	TorrentFileManager(Torrent *torrent);
 	~TorrentFileManager();
 
-	const bitset *completedBits() const;
+	const atomic_bitset *completedBits() const;
 	size_t pending() const;
 	size_t pieceSize(size_t index) const;
 	size_t completedPieces() const;
 	size_t totalPieces() const;
-	size_t getPieceforRequest(const std::function<bool (size_t)> &fun);
-	size_t computeDownloaded();
+	size_t completedBytes() const;
+
+	// Rarest first among the pieces set in pieces (what the peer has),
+	// max size_t if there's nothing to get.  Pieces with a deadline come
+	// first for fast peers.  Every piece handed out must be given back with
+	// releasePiece() once that peer is done with it.  joinPiece() hands out
+	// a piece that someone else is already downloading.
+	size_t getPieceforRequest(const bitset *pieces, const std::function<bool (size_t)> &downloading, bool fast, bool blocksOut);
+	void joinPiece(size_t index);
+	void releasePiece(size_t index);
+	void setPieceDeadlines(const PieceDeadlines &deadlines);
+
+	// Peers announcing pieces (have/bitfield) and leaving
+	void addAvailability(size_t index);
+	void removeAvailability(const bitset *pieces);
 
 	bool pieceDone(size_t index) const;
 	bool piecePending(size_t index) const;
-	bool registerFiles(const std::string &baseDir, const TorrentFiles &files);
+	bool registerFiles(const std::string &baseDir, const TorrentFiles &files, StorageMode mode);
 	bool requestPieceBlock(size_t index, uint32_t from, size_t begin, size_t size);
-	bool writePieceBlock(size_t index, uint32_t from, DataBuffer<uint8_t> &&data);
+	// Where a block we have lies if it's all in one file, so it can be
+	// sent without reading it first.
+	bool blockFile(size_t index, size_t begin, size_t size, int &fd, uint64_t &offset) const;
+	// digest is the piece's SHA-1 as hashed while its blocks came in.
+	// Torrent::onPieceWriteComplete() or onPieceHashFailed() tell how it
+	// went.  False if the piece is already had or on its way to disk.
+	bool writePieceBlock(size_t index, uint32_t from, DataBuffer<uint8_t> &&data, const uint32_t *digest);
+	void cancelPieceBlock(size_t index, uint32_t from, size_t begin, size_t size);
+	void cancelRequests(uint32_t from);
+
+	// Number of disk and hashing threads shared by all torrents, 0 hashing
+	// threads means one per CPU.
+	static void setDiskThreads(size_t count);
+	static void setHashThreads(size_t count);
 
 private:
 	TorrentFileManagerImpl *i;
@@ -22,7 +22,7 @@
 #include "torrentmeta.h"
 
 #include <util/auxiliar.h>
-#include <boost/uuid/sha1.hpp>
+#include <util/sha1.h>
 
 TorrentMeta::TorrentMeta()
 	: m_pieceLength(0),
@@ -81,9 +81,7 @@ bool TorrentMeta::internalParse(Dictionary &dict, Bencode &bencode)
 	size_t bufferSize;
 	const char *buffer = bencode.buffer(pos, bufferSize);
 
-	boost::uuids::detail::sha1 sha1;
-	sha1.process_bytes(buffer, bufferSize);
-	sha1.get_digest(m_checkSum);
+	Sha1::hash(buffer, bufferSize, m_checkSum);
 
 	m_name = Bencode::cast<std::string>(info["name"]);
 	m_pieceLength = Bencode::cast<uint64_t>(info["piece length"]);
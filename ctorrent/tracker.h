@@ -67,6 +67,7 @@ public:
 	bool query(const TrackerQuery &request);
 	bool timeUp(void) { return std::chrono::system_clock::now() >= m_timeToNextRequest; }
 	void setNextRequestTime(const TimePoint &p) { m_timeToNextRequest = p; }
+	const TimePoint &nextRequestTime() const { return m_timeToNextRequest; }
 
 protected:
 	bool httpRequest(const TrackerQuery &r);
@@ -21,11 +21,12 @@
  */
 #include <ctorrent/torrent.h>
 #include <net/connection.h>
+#include <net/shards.h>
 #include <util/auxiliar.h>
+#include <util/sha1.h>
+#include <util/bufferpool.h>
 
-#include <thread>
 #include <functional>
-#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <boost/program_options.hpp>
@@ -37,6 +38,8 @@
 /* Externed  */
 std::ofstream logfile;
 
+#define STATUS_INTERVAL	250	// ms between redraws
+
 #ifdef _WIN32
 enum {
 	COL_BLACK = 0,
@@ -82,9 +85,9 @@ static void print_stats(Torrent *t)
 	TorrentFileManager *fm = t->fileManager();
 
 	printc(COL_GREEN, "\r%s: ", meta->name().c_str());
-	printc(COL_YELLOW, "%.2f Mbps (%zd/%zd MB) [ %zd uploaded - %zd hash miss - %zd wasted - %.2f seconds left ] ",
-				t->downloadSpeed(), t->computeDownloaded() / 1024 / 1024, meta->totalSize() / 1024 / 1024,
-				t->uploadedBytes(), t->hashMisses(), t->wastedBytes(), t->eta());
+	printc(COL_YELLOW, "%.2f/%.2f Mbps down/up (%zd/%zd MB) [ %zd uploaded - %zd hash miss - %zd wasted - %zd redundant - %.2f seconds left ] ",
+				t->downloadSpeed() * 8 / 1e6, t->uploadSpeed() * 8 / 1e6, t->completedBytes() / 1024 / 1024, meta->totalSize() / 1024 / 1024,
+				t->uploadedBytes(), t->hashMisses(), t->wastedBytes(), t->redundantBytes(), t->eta());
 	printc(COL_YELLOW, "[ %zd/%zd/%zd pieces %zd peers active ]\n",
 				fm->completedPieces(), fm->pending(), fm->totalPieces(), t->activePeers());
 }
@@ -102,6 +105,8 @@ static void print_all_stats(Torrent *torrents, size_t total)
 #endif
 	for (size_t i = 0; i < total; ++i)
 		print_stats(&torrents[i]);
+	printc(COL_GREEN, "Total: ");
+	printc(COL_YELLOW, "%.2f/%.2f Mbps down/up\n", g_downloadMeter.rate() * 8 / 1e6, g_uploadMeter.rate() * 8 / 1e6);
 #ifdef _WIN32
 	SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), coord);
 #else
@@ -112,10 +117,19 @@ static void print_all_stats(Torrent *torrents, size_t total)
 
 int main(int argc, char *argv[])
 {
-	bool noseed = true;
+	bool noseed = false;
 	bool nodownload = false;
+	std::string storage = "buffered";
 	int startport = 6881;
 	size_t max_peers = 30;
+	size_t disk_threads = 1;
+	size_t hash_threads = 0;
+	size_t stream_rate = 0;
+	size_t net_threads = 1;
+	size_t upload_slots = 0;
+	size_t upload_limit = 0;
+	size_t download_limit = 0;
+	bool limit_lan = false;
 	std::string dldir = "Torrents";
 	std::string lfname = "out.txt";
 	std::vector<std::string> files;
@@ -131,7 +145,17 @@ int main(int argc, char *argv[])
 		("piecesize,s", po::value(&maxRequestSize), "specify piece block size")
 		("dldir,d", po::value(&dldir), "specify downloads directory")
 		("noseed,e", po::bool_switch(&noseed), "do not seed after download has finished.")
+		("storage,S", po::value(&storage), "torrent storage backend: buffered, mmap or uring")
+		("diskthreads,j", po::value(&disk_threads), "number of disk I/O threads shared by all torrents")
+		("hashthreads", po::value(&hash_threads), "number of piece hashing threads, 0 for one per CPU")
+		("netthreads,N", po::value(&net_threads), "number of network threads, peers are spread over them")
+		("uploadslots,U", po::value(&upload_slots), "peers to upload to at a time per torrent, 0 sizes it to the upload capacity")
+		("uplimit,u", po::value(&upload_limit), "limit the upload rate of all torrents together to this many KiB/s")
+		("downlimit,D", po::value(&download_limit), "limit the download rate of all torrents together to this many KiB/s")
+		("limitlan", po::bool_switch(&limit_lan), "apply the rate limits to peers on the local network too")
+		("stream,r", po::value(&stream_rate), "streaming mode: fetch pieces in order, just ahead of a reader consuming every file at this many KiB/s")
 		("log,l", po::value(&lfname), "specify log file name")
+		("hashbench", "check and benchmark the SHA-1 engines this CPU supports, then exit")
 		("torrents,t", po::value<std::vector<std::string>>(&files)->required()->multitoken(), "specify torrent file(s)");
 
 	if (argc == 1) {
@@ -143,7 +167,8 @@ int main(int argc, char *argv[])
 	po::variables_map vm;
 	try {
 		po::store(po::parse_command_line(argc, argv, opts), vm);
-		po::notify(vm);
+		if (!vm.count("hashbench"))
+			po::notify(vm);
 	} catch (const std::exception &e) {
 		std::cerr << argv[0] << ": error parsing command line arguments: " << e.what() << std::endl;
 		std::clog << opts << std::endl;
@@ -162,6 +187,37 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (vm.count("hashbench")) {
+		bool ok = true;
+		std::clog << "SHA-1 engine in use: " << Sha1::engineName() << std::endl;
+		for (const std::string &engine : Sha1::engines()) {
+			bool passed = Sha1::selfTest(engine);
+			std::clog << engine << ": " << (passed ? "passed" : "FAILED");
+			if (passed)
+				std::clog << ", " << (size_t)Sha1::benchmark(engine, 1 << 20) << " MB/s";
+			std::clog << std::endl;
+			ok = ok && passed;
+		}
+
+		return ok ? 0 : 1;
+	}
+
+	StorageMode mode = StorageMode::Buffered;
+	if (storage == "mmap")
+		mode = StorageMode::Mapped;
+	else if (storage == "uring")
+		mode = StorageMode::Uring;
+	else if (storage != "buffered") {
+		std::cerr << argv[0] << ": unknown storage backend " << storage << std::endl;
+		return 1;
+	}
+
+	g_shards.start(net_threads);
+	g_uploadLimiter.setLimit(upload_limit * 1024);
+	g_downloadLimiter.setLimit(download_limit * 1024);
+	TorrentFileManager::setDiskThreads(disk_threads);
+	TorrentFileManager::setHashThreads(hash_threads);
+
 	if (vm.count("piecesize"))
 		maxRequestSize = 1 << (32 - __builtin_clz(maxRequestSize - 1));
 
@@ -175,7 +231,6 @@ int main(int argc, char *argv[])
 	size_t total_bits = 0;
 	size_t completed = 0;
 	size_t errors = 0;
-	size_t eseed = 0;
 	size_t started = 0;
 
 	std::vector<Torrent> torrents(total);
@@ -185,13 +240,18 @@ int main(int argc, char *argv[])
 		total_bits |= 1 << i;
 
 		std::clog << "Scanning: " << file << "... ";
-		if (!t->open(file, dldir)) {
+		if (!t->open(file, dldir, mode)) {
 			std::cerr << "corrupted torrent file" << std::endl;
 			errors |= 1 << i;
 			continue;
 		}
 		std::clog << "Done" << std::endl;
 
+		if (stream_rate)
+			t->setStreamRate(stream_rate * 1024);
+		t->setUploadSlots(upload_slots);
+		t->setLimitLocal(limit_lan);
+
 		const TorrentMeta *meta = t->meta();
 		if (nodownload) {
 			const TorrentFileManager *fm = t->fileManager();
@@ -233,52 +293,56 @@ int main(int argc, char *argv[])
 
 	if (!nodownload && started > 0) {
 		std::clog << "Downloading torrents..." << std::endl;
-		while (total_bits ^ (completed | errors)) {
-			for (size_t i = 0; i < total; ++i) {
-				if (errors & (1 << i))
-					continue;
-
-				Torrent *t = &torrents[i];
-				if (t->isFinished()) {
-					if (!noseed)
-						t->finish();
-					completed |= 1 << i;
-				} else {
-					if (max_peers == 0 || t->activePeers() < max_peers)
-						t->checkTrackers();
-					if (!noseed)
-						t->nextConnection();
-				}
-			}
-
-			Connection::poll();
-			print_all_stats(&torrents[0], total);
-			std::this_thread::sleep_for(std::chrono::milliseconds(5));
-		}
-	}
-
-	std::clog << "\nDone downloading\n" << std::endl;
-	if (!noseed && completed > 0) {
-		std::clog << "Now seeding" << std::endl;
 		for (size_t i = 0; i < total; ++i) {
 			Torrent *t = &torrents[i];
-			if (!t->hasTrackers())
-				eseed |= 1 << i;
+			if ((completed | errors) & (1 << i))
+				continue;
+
+			if (t->isFinished())
+				completed |= 1 << i;
+			t->setFinishedCallback([&, i] () {
+				if (completed & (1 << i))
+					return;
+
+				completed |= 1 << i;
+				if (!noseed)
+					return;
+
+				torrents[i].finish();
+				if (!(total_bits ^ (completed | errors)))
+					g_service.stop();
+			});
+			t->start(max_peers);
 		}
 
-		while (eseed ^ total_bits) {
-			for (size_t i = 0; i < total; ++i) {
-				Torrent *t = &torrents[i];
-				if (!t->nextConnection() || (t->activePeers() < max_peers && !t->checkTrackers()))
-					eseed |= 1 << i;
-			}
-
-			Connection::poll();
+		// Everything happens in handlers from here on
+		asio::deadline_timer status(g_service);
+		std::function<void()> redraw = [&] () {
 			print_all_stats(&torrents[0], total);
-			std::this_thread::sleep_for(std::chrono::milliseconds(5));
-		}
+			status.expires_from_now(boost::posix_time::milliseconds(STATUS_INTERVAL));
+			status.async_wait([&] (const boost::system::error_code &e) {
+				if (!e)
+					redraw();
+			});
+		};
+
+		asio::signal_set signals(g_service, SIGINT, SIGTERM);
+		signals.async_wait([] (const boost::system::error_code &e, int) {
+			if (!e)
+				g_service.stop();
+		});
+
+		redraw();
+		g_service.run();
+		print_all_stats(&torrents[0], total);
+
+		for (size_t i = 0; i < total; ++i)
+			if (!(errors & (1 << i)))
+				torrents[i].finish();
 	}
 
+	g_shards.stop();
+
 #ifndef _WIN32
 	endwin();
 #endif
@@ -290,11 +354,14 @@ int main(int argc, char *argv[])
 			std::clog << "Completed: ";
 		else if (errors & (1 << i))
 			std::clog << "Something went wrong downloading: ";
-		else if (eseed & (1 << i))
-			std::clog << "Failed to seed: ";
+		else
+			std::clog << "Stopped: ";
 		std::clog << meta->name() << std::endl;
 	}
 
+	BufferPool::Counters pool = BufferPool::counters();
+	logfile << "Buffer pool: " << pool.hits << " hits, " << pool.misses << " misses" << std::endl;
+
 	std::clog << "Finished" << std::endl;
 	logfile.close();
 	return 0;
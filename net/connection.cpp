@@ -20,16 +20,33 @@
  * THE SOFTWARE.
  */
 #include "connection.h"
+#include "shards.h"
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#else
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+#include <limits>
 
 asio::io_service g_service;
-static std::mutex g_connectionLock;
-static std::list<std::shared_ptr<asio::streambuf>> g_outputStreams;
 
 Connection::Connection() :
-	m_delayedWriteTimer(g_service),
-	m_connectTimer(g_service),
-	m_resolver(g_service),
-	m_socket(g_service)
+	Connection(g_shards.next())
+{
+
+}
+
+Connection::Connection(asio::io_service &service) :
+	m_service(service),
+	m_connectTimer(service),
+	m_resolver(service),
+	m_socket(service),
+	m_writing(false),
+	m_writeTimer(service),
+	m_readTimer(service)
 {
 
 }
@@ -39,17 +56,10 @@ Connection::~Connection()
 	boost::system::error_code ec;
 	m_socket.cancel(ec);
 
-	m_delayedWriteTimer.cancel();
 	if (m_socket.is_open())
 		m_socket.close();
 }
 
-void Connection::poll()
-{
-	g_service.reset();
-	g_service.poll();
-}
-
 void Connection::connect(const std::string &host, const std::string &port, const ConnectCallback &cb)
 {
 	asio::ip::tcp::resolver::query query(host, port);
@@ -61,12 +71,26 @@ void Connection::connect(const std::string &host, const std::string &port, const
 
 void Connection::close(bool warn)
 {
-	m_delayedWriteTimer.cancel();
+	close(warn, nullptr);
+}
+
+void Connection::close(bool warn, const CloseCallback &closed)
+{
+	m_service.dispatch(std::bind(&Connection::doClose, shared_from_this(), warn, closed));
+}
+
+void Connection::doClose(bool warn, const CloseCallback &closed)
+{
 	m_connectTimer.cancel();
+	m_writeTimer.cancel();
+	m_readTimer.cancel();
+	m_sendQueue.clear();
 
 	if (!isConnected()) {
 		if (m_eh && warn)
 			m_eh("Connection::close(): Called on an already closed connection!");
+		if (closed)
+			closed();
 		return;
 	}
 
@@ -74,32 +98,60 @@ void Connection::close(bool warn)
 	m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
 	m_socket.close();
 
-	if (ec && warn && m_eh)
+	if (!warn)
+		m_eh = nullptr;
+	else if (ec && m_eh)
 		m_eh(ec.message());
+	if (closed)
+		closed();
 }
 
 void Connection::write(const uint8_t *bytes, size_t size)
+{
+	SharedBuffer buffer = std::make_shared<DataBuffer<uint8_t>>(size);
+	memcpy(buffer->data(), bytes, size);
+	buffer->setSize(size);
+	write(buffer);
+}
+
+void Connection::write(const SharedBuffer &buffer)
+{
+	write(buffer, 0, buffer->size());
+}
+
+void Connection::write(const SharedBuffer &buffer, size_t offset, size_t size)
+{
+	m_service.dispatch(std::bind(&Connection::queue, shared_from_this(), buffer, -1, offset, size));
+}
+
+void Connection::queue(const SharedBuffer &buffer, int fd, uint64_t offset, size_t size)
 {
 	if (!isConnected())
 		return;
 
-	if (!m_outputStream) {
-		g_connectionLock.lock();
-		if (!g_outputStreams.empty()) {
-			m_outputStream = g_outputStreams.front();
-			g_outputStreams.pop_front();
-		} else
-			m_outputStream = std::shared_ptr<asio::streambuf>(new asio::streambuf);
-		g_connectionLock.unlock();
-
-		m_delayedWriteTimer.cancel();
-		m_delayedWriteTimer.expires_from_now(boost::posix_time::milliseconds(10));
-		m_delayedWriteTimer.async_wait(std::bind(&Connection::internalWrite, shared_from_this(), std::placeholders::_1));
+	Chunk chunk = { buffer, fd, offset, size };
+	m_sendQueue.push_back(chunk);
+	if (!m_writing) {
+		// Whatever else gets queued before the socket is writable goes
+		// out along with this.
+		m_writing = true;
+		m_socket.async_write_some(asio::null_buffers(),
+					  std::bind(&Connection::handleWritable, shared_from_this(), std::placeholders::_1));
 	}
+}
 
-	std::ostream os(m_outputStream.get());
-	os.write((const char *)bytes, size);
-	os.flush();
+void Connection::writeFile(int fd, uint64_t offset, size_t size)
+{
+#ifdef __linux__
+	m_service.dispatch(std::bind(&Connection::queue, shared_from_this(), nullptr, fd, offset, size));
+#else
+	SharedBuffer buffer = std::make_shared<DataBuffer<uint8_t>>(size);
+	if (pread(fd, buffer->data(), size, offset) != (ssize_t)size)
+		return handleError(asio::error::broken_pipe);
+
+	buffer->setSize(size);
+	write(buffer);
+#endif
 }
 
 void Connection::read_partial(size_t bytes, const ReadCallback &rc)
@@ -107,44 +159,186 @@ void Connection::read_partial(size_t bytes, const ReadCallback &rc)
 	if (!isConnected())
 		return;
 
+	ConnectionPtr self = shared_from_this();
+	if (!readQuota(bytes, true, [self, bytes, rc] () { self->read_partial(bytes, rc); }))
+		return;
+
 	m_rc = rc;
 	m_socket.async_read_some(asio::buffer(m_inputStream.prepare(bytes)),
 				 std::bind(&Connection::handleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
 }
 
+void Connection::read_partial(uint8_t *buffer, size_t bytes, const ReadCallback &rc)
+{
+	if (!isConnected())
+		return;
+
+	ConnectionPtr self = shared_from_this();
+	if (!readQuota(bytes, true, [self, buffer, bytes, rc] () { self->read_partial(buffer, bytes, rc); }))
+		return;
+
+	m_rc = rc;
+	m_socket.async_read_some(asio::buffer(buffer, bytes),
+				 std::bind(&Connection::handleReadInto, shared_from_this(), std::placeholders::_1, std::placeholders::_2, buffer));
+}
+
 void Connection::read(size_t bytes, const ReadCallback &rc)
 {
 	if (!isConnected())
 		return;
 
+	ConnectionPtr self = shared_from_this();
+	if (!readQuota(bytes, false, [self, bytes, rc] () { self->read(bytes, rc); }))
+		return;
+
 	m_rc = rc;
 	asio::async_read(m_socket, asio::buffer(m_inputStream.prepare(bytes)),
 			 std::bind(&Connection::handleRead, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
 }
 
-void Connection::internalWrite(const boost::system::error_code &e)
+void Connection::read(uint8_t *buffer, size_t bytes, const ReadCallback &rc)
 {
-	m_delayedWriteTimer.cancel();
+	if (!isConnected())
+		return;
 
-	if (e == asio::error::operation_aborted || !m_socket.is_open())
+	ConnectionPtr self = shared_from_this();
+	if (!readQuota(bytes, false, [self, buffer, bytes, rc] () { self->read(buffer, bytes, rc); }))
 		return;
 
-	std::shared_ptr<asio::streambuf> outputStream = m_outputStream;
-	m_outputStream = nullptr;
+	m_rc = rc;
+	asio::async_read(m_socket, asio::buffer(buffer, bytes),
+			 std::bind(&Connection::handleReadInto, shared_from_this(), std::placeholders::_1, std::placeholders::_2, buffer));
+}
+
+// A partial read is cut down to the quota, a full one only has to find
+// some (and goes into debt for the rest).  False if there's none, retry is
+// called once there is.
+bool Connection::readQuota(size_t &bytes, bool partial, const std::function<void()> &retry)
+{
+	if (!m_download)
+		return true;
+
+	size_t allowed = m_download->quota(bytes);
+	if (allowed == 0) {
+		waitForQuota(m_readTimer, m_download.get(), retry);
+		return false;
+	}
+
+	if (partial)
+		bytes = allowed;
+	return true;
+}
+
+void Connection::waitForQuota(asio::deadline_timer &timer, RateLimiter *limiter, const std::function<void()> &retry)
+{
+	timer.expires_from_now(boost::posix_time::milliseconds(limiter->delay()));
+	timer.async_wait([retry] (const boost::system::error_code &e) {
+		if (!e)
+			retry();
+	});
+}
+
+void Connection::handleWritable(const boost::system::error_code &e)
+{
+	if (e) {
+		m_writing = false;
+		return handleError(e);
+	}
 
-	asio::async_write(m_socket, *outputStream,
-			  std::bind(&Connection::handleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2, outputStream));
+	flush();
 }
 
-void Connection::handleWrite(const boost::system::error_code &e, size_t bytes, std::shared_ptr<asio::streambuf> outputStream)
+void Connection::flush()
 {
-	if (e == asio::error::operation_aborted)
+	if (m_sendQueue.empty() || !m_socket.is_open()) {
+		m_writing = false;
 		return;
+	}
 
-	outputStream->consume(outputStream->size());
-	g_outputStreams.push_back(outputStream);
-	if (e)
-		handleError(e);
+	size_t allowance = std::numeric_limits<size_t>::max();
+	if (m_upload && (allowance = m_upload->quota(allowance)) == 0)
+		return waitForQuota(m_writeTimer, m_upload.get(), std::bind(&Connection::flush, shared_from_this()));
+
+	if (!m_sendQueue.front().buffer)
+		return sendFile(allowance);
+
+	// Every buffer up to the next file range, or as many as the quota
+	// covers (at least one)
+	std::vector<asio::const_buffer> buffers;
+	size_t bytes = 0;
+	while (!m_sendQueue.empty() && m_sendQueue.front().buffer && bytes < allowance) {
+		const Chunk &c = m_sendQueue.front();
+		buffers.push_back(asio::buffer(c.buffer->data() + c.offset, c.size));
+		bytes += c.size;
+		m_sending.push_back(c.buffer);
+		m_sendQueue.pop_front();
+	}
+
+	if (m_upload)
+		m_upload->consume(bytes);
+
+	asio::async_write(m_socket, buffers,
+			  std::bind(&Connection::handleWrite, shared_from_this(), std::placeholders::_1, std::placeholders::_2));
+}
+
+// Nothing in between for sendfile(), the socket is put in non-blocking mode
+// and whatever doesn't go out now waits for the next time it's writable, or
+// for more quota.
+void Connection::sendFile(size_t allowance)
+{
+#ifdef __linux__
+	boost::system::error_code ec;
+	m_socket.native_non_blocking(true, ec);
+	if (ec) {
+		m_writing = false;
+		return handleError(ec);
+	}
+
+	Chunk &chunk = m_sendQueue.front();
+	while (chunk.size > 0) {
+		if (allowance == 0)
+			return flush();
+
+		off_t offset = chunk.offset;
+		ssize_t sent = ::sendfile(m_socket.native_handle(), chunk.fd, &offset, std::min(chunk.size, allowance));
+		if (sent > 0) {
+			chunk.offset += sent;
+			chunk.size -= sent;
+			allowance -= sent;
+			if (m_upload)
+				m_upload->consume(sent);
+			continue;
+		}
+
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			m_socket.async_write_some(asio::null_buffers(),
+						  std::bind(&Connection::handleWritable, shared_from_this(), std::placeholders::_1));
+			return;
+		}
+
+		// 0 means the file got shorter under us
+		m_writing = false;
+		return handleError(boost::system::error_code(sent < 0 ? errno : EIO, boost::system::system_category()));
+	}
+
+	m_sendQueue.pop_front();
+	flush();
+#endif
+}
+
+void Connection::handleWrite(const boost::system::error_code &e, size_t bytes)
+{
+	m_sending.clear();
+	if (e) {
+		m_writing = false;
+		return handleError(e);
+	}
+
+	// More was queued while that was going out
+	flush();
 }
 
 void Connection::handleRead(const boost::system::error_code &e, size_t readSize)
@@ -152,6 +346,8 @@ void Connection::handleRead(const boost::system::error_code &e, size_t readSize)
 	if (e)
 		return handleError(e);
 
+	if (m_download)
+		m_download->consume(readSize);
 	if (m_rc) {
 		const uint8_t *data = asio::buffer_cast<const uint8_t *>(m_inputStream.data());
 		m_rc(data, readSize);
@@ -160,6 +356,17 @@ void Connection::handleRead(const boost::system::error_code &e, size_t readSize)
 	m_inputStream.consume(readSize);
 }
 
+void Connection::handleReadInto(const boost::system::error_code &e, size_t readSize, uint8_t *buffer)
+{
+	if (e)
+		return handleError(e);
+
+	if (m_download)
+		m_download->consume(readSize);
+	if (m_rc)
+		m_rc(buffer, readSize);
+}
+
 void Connection::handleResolve(const boost::system::error_code &e,
 			       asio::ip::basic_resolver<asio::ip::tcp>::iterator endpoint)
 {
@@ -36,51 +36,96 @@
 
 #include <util/auxiliar.h>
 
-#include <mutex>
-#include <list>
+#include <memory>
+#include <vector>
+#include <deque>
 
 #include "outputmessage.h"
+#include "ratelimiter.h"
 
 namespace asio = boost::asio;
 
+// Outgoing data is queued by reference, and everything queued by the time
+// the socket becomes writable goes out in one gathered write.
+//
+// A connection belongs to one io_service (shard) and its handlers only run
+// there.  write(), writeFile() and close() may be called from any thread,
+// they're carried over to that shard if need be.
+//
+// With rate limiters set, reads and writes that find no quota wait on a
+// timer for it, partial reads are cut down to what's left.
+typedef std::shared_ptr<DataBuffer<uint8_t>> SharedBuffer;
+
 class Connection : public std::enable_shared_from_this<Connection>
 {
 	typedef std::function<void(const uint8_t *, size_t)> ReadCallback;
 	typedef std::function<void()> ConnectCallback;
+	typedef std::function<void()> CloseCallback;
 	typedef std::function<void(const std::string &)> ErrorCallback;
 
 public:
 	Connection();
+	Connection(asio::io_service &service);
 	~Connection();
 
-	// poll io service (general purpose)
-	static void poll();
-
+	asio::io_service &service() { return m_service; }
 	void setErrorCallback(const ErrorCallback &ec) { m_eh = ec; }
+	// Before the first read or write, either may be null
+	void setLimiters(const std::shared_ptr<RateLimiter> &upload, const std::shared_ptr<RateLimiter> &download) { m_upload = upload; m_download = download; }
 	void connect(const std::string &host, const std::string &port, const ConnectCallback &cb);
-	void close(bool warn = true);	/// Pass false in ErrorCallback otherwise possible infinite recursion
+	void close(bool warn = true);	/// Pass false in ErrorCallback otherwise possible infinite recursion, also drops the callback
+	// closed runs on the connection's thread once the socket is closed and
+	// no read can touch its buffer anymore.
+	void close(bool warn, const CloseCallback &closed);
 	bool isConnected() const { return m_socket.is_open(); }
 
 	inline void write(const OutputMessage &o) { write(o.data(0), o.size()); }
+	inline void write(OutputMessage &&o) { write(std::make_shared<DataBuffer<uint8_t>>(o.take())); }
 	inline void write(const std::string &str) { return write((const uint8_t *)str.c_str(), str.length()); }
 	void write(const uint8_t *data, size_t bytes);
+	void write(const SharedBuffer &buffer);
+	// size bytes of buffer from offset, without copying them
+	void write(const SharedBuffer &buffer, size_t offset, size_t size);
+	// size bytes of fd from offset, sent by the kernel (sendfile) without
+	// going through user space where that's supported.  fd has to stay open
+	// until the connection is closed.
+	void writeFile(int fd, uint64_t offset, size_t size);
 	void read_partial(size_t bytes, const ReadCallback &rc);
 	void read(size_t bytes, const ReadCallback &rc);
+	// Straight into buffer, which must stay around until rc is called or
+	// the connection is closed.
+	void read(uint8_t *buffer, size_t bytes, const ReadCallback &rc);
+	void read_partial(uint8_t *buffer, size_t bytes, const ReadCallback &rc);
 
 	std::string getIPString() const;
 	uint32_t getIP() const;
 
 protected:
-	void internalWrite(const boost::system::error_code &);
+	void queue(const SharedBuffer &buffer, int fd, uint64_t offset, size_t size);
+	void doClose(bool warn, const CloseCallback &closed);
+	void handleWritable(const boost::system::error_code &);
+	void flush();
+	void sendFile(size_t allowance);
+	bool readQuota(size_t &bytes, bool partial, const std::function<void()> &retry);
+	void waitForQuota(asio::deadline_timer &timer, RateLimiter *limiter, const std::function<void()> &retry);
 	void handleRead(const boost::system::error_code &, size_t);
-	void handleWrite(const boost::system::error_code &, size_t, std::shared_ptr<asio::streambuf>);
+	void handleReadInto(const boost::system::error_code &, size_t, uint8_t *);
+	void handleWrite(const boost::system::error_code &, size_t);
 	void handleConnect(const boost::system::error_code &);
 	void handleResolve(const boost::system::error_code &, asio::ip::basic_resolver<asio::ip::tcp>::iterator);
 	void handleError(const boost::system::error_code &);
 	void handleTimeout(const boost::system::error_code &);
 
 private:
-	asio::deadline_timer m_delayedWriteTimer;
+	// A range of either a buffer or a file
+	struct Chunk {
+		SharedBuffer buffer;
+		int fd;
+		uint64_t offset;
+		size_t size;
+	};
+
+	asio::io_service &m_service;
 	asio::deadline_timer m_connectTimer;
 	asio::ip::tcp::resolver m_resolver;
 	asio::ip::tcp::socket m_socket;
@@ -89,9 +134,16 @@ private:
 	ConnectCallback m_cb;
 	ErrorCallback m_eh;
 
-	std::shared_ptr<asio::streambuf> m_outputStream;
+	std::deque<Chunk> m_sendQueue;
+	std::vector<SharedBuffer> m_sending;	// in the write in flight
+	bool m_writing;
 	asio::streambuf m_inputStream;
 
+	std::shared_ptr<RateLimiter> m_upload;
+	std::shared_ptr<RateLimiter> m_download;
+	asio::deadline_timer m_writeTimer;
+	asio::deadline_timer m_readTimer;
+
 	friend class Server;
 };
 typedef std::shared_ptr<Connection> ConnectionPtr;
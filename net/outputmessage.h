@@ -44,6 +44,9 @@ public:
 	void addU64(uint64_t val);
 	void addString(const std::string &str);
 
+	// Hands the message over without copying it, leaves this one empty
+	DataBuffer<uint8_t> take() { m_buffer.setSize(m_pos); m_pos = 0; return std::move(m_buffer); }
+
 	const uint8_t *data() const { return &m_buffer[m_pos]; }
 	const uint8_t *data(size_t p) const { return &m_buffer[p]; }
 	size_t size() const { return m_pos; }
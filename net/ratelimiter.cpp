@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ratelimiter.h"
+
+#include <algorithm>
+
+RateLimiter g_uploadLimiter;
+RateLimiter g_downloadLimiter;
+
+RateLimiter::RateLimiter(RateLimiter *parent)
+	: m_parent(parent),
+	  m_limit(0),
+	  m_tokens(0),
+	  m_lastRefill(Clock::now())
+{
+}
+
+void RateLimiter::setLimit(size_t limit)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_limit = limit;
+	m_tokens = std::min<double>(m_tokens, limit);
+	m_lastRefill = Clock::now();
+}
+
+// m_mutex held
+void RateLimiter::refill(Clock::time_point now)
+{
+	std::chrono::duration<double> elapsed = now - m_lastRefill;
+	double burst = std::max<double>(m_limit * BurstTime / 1000.0, MinBurst);
+
+	m_tokens = std::min(m_tokens + elapsed.count() * m_limit, burst);
+	m_lastRefill = now;
+}
+
+size_t RateLimiter::quota(size_t want)
+{
+	Clock::time_point now = Clock::now();
+	for (RateLimiter *l = this; l && want != 0; l = l->m_parent) {
+		if (l->m_limit == 0)
+			continue;
+
+		std::lock_guard<std::mutex> guard(l->m_mutex);
+		l->refill(now);
+		want = l->m_tokens < 1 ? 0 : std::min<double>(want, l->m_tokens);
+	}
+
+	return want;
+}
+
+void RateLimiter::consume(size_t bytes)
+{
+	for (RateLimiter *l = this; l; l = l->m_parent) {
+		if (l->m_limit == 0)
+			continue;
+
+		std::lock_guard<std::mutex> guard(l->m_mutex);
+		l->m_tokens -= bytes;
+	}
+}
+
+long RateLimiter::delay()
+{
+	Clock::time_point now = Clock::now();
+	double wait = 0;
+	for (RateLimiter *l = this; l; l = l->m_parent) {
+		if (l->m_limit == 0)
+			continue;
+
+		// setLimit() may have turned it off since, it can't under the lock
+		std::lock_guard<std::mutex> guard(l->m_mutex);
+		size_t limit = l->m_limit;
+		if (limit == 0)
+			continue;
+
+		l->refill(now);
+		if (l->m_tokens < 1)
+			wait = std::max(wait, (1 - l->m_tokens) / limit);
+	}
+
+	return std::max<long>(1, wait * 1000 + 0.5);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RATELIMITER_H
+#define __RATELIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stddef.h>
+
+// Token bucket, refilled by the time passed whenever it is looked at.
+// Buckets are chained (peer -> torrent -> session), traffic has to get
+// through every bucket up the chain and is taken off all of them.
+//
+// A connection asks for quota() before reading or writing and consume()s
+// what really went through, which may be more than it was given: the
+// bucket goes into debt and quota() stays 0 until it's paid back.  That
+// way messages are never split to fit.
+class RateLimiter {
+public:
+	enum {
+		MinBurst = 16384 + 13,	// a whole block with its header
+		BurstTime = 250		// ms of traffic a bucket saves up at most
+	};
+
+	explicit RateLimiter(RateLimiter *parent = nullptr);
+
+	// Bytes per second, 0 is unlimited.  Any thread, any time.
+	void setLimit(size_t limit);
+	size_t limit() const { return m_limit; }
+
+	// How much of want may go through now, 0 until delay() has passed
+	size_t quota(size_t want);
+	void consume(size_t bytes);
+	// Milliseconds until quota() gives something again
+	long delay();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	void refill(Clock::time_point now);
+
+	RateLimiter *m_parent;
+	std::atomic<size_t> m_limit;
+
+	std::mutex m_mutex;
+	double m_tokens;
+	Clock::time_point m_lastRefill;
+};
+
+extern RateLimiter g_uploadLimiter;
+extern RateLimiter g_downloadLimiter;
+
+#endif
@@ -22,7 +22,8 @@
 #include "server.h"
 
 Server::Server(uint16_t port)
-	: m_acceptor(g_service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
+	: m_stopped(false),
+	  m_acceptor(g_service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port))
 {
 	m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
 }
@@ -36,11 +37,17 @@ Server::~Server()
 
 void Server::stop()
 {
-	m_acceptor.cancel();
-	m_acceptor.close();
+	if (m_stopped)
+		return;
+
+	boost::system::error_code ec;
+	m_acceptor.cancel(ec);
+	m_acceptor.close(ec);
 	m_stopped = true;
 }
 
+// Only accepting happens on g_service, the connection itself is handed to
+// the next network thread.
 void Server::accept(const Acceptor &ac)
 {
 	ConnectionPtr conn(new Connection());
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "shards.h"
+#include "connection.h"
+
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+Shards g_shards;
+
+static void pin(std::thread::native_handle_type thread, size_t cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % std::max(1U, std::thread::hardware_concurrency()), &set);
+	pthread_setaffinity_np(thread, sizeof(set), &set);
+#endif
+}
+
+Shards::Shards()
+	: m_next(1)	// the main thread has enough to do
+{
+}
+
+Shards::~Shards()
+{
+	stop();
+}
+
+void Shards::start(size_t count)
+{
+	for (size_t i = 1; i < count; ++i) {
+		asio::io_service *service = new asio::io_service(1);
+		m_services.push_back(std::unique_ptr<asio::io_service>(service));
+		m_work.push_back(std::unique_ptr<asio::io_service::work>(new asio::io_service::work(*service)));
+		m_threads.push_back(std::thread([service] () { service->run(); }));
+		pin(m_threads.back().native_handle(), i);
+	}
+}
+
+// The services themselves stay, connections still around belong to them
+void Shards::stop()
+{
+	m_work.clear();
+	for (const std::unique_ptr<asio::io_service> &service : m_services)
+		service->stop();
+	for (std::thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+}
+
+asio::io_service &Shards::next()
+{
+	size_t shard = m_next++ % count();
+	return shard == 0 ? g_service : *m_services[shard - 1];
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __SHARDS_H
+#define __SHARDS_H
+
+#include <boost/asio.hpp>
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+namespace asio = boost::asio;
+
+// Network threads.  Each runs an io_service of its own (a shard) and every
+// connection is created on one of them and stays there, shard 0 being
+// g_service which the main thread runs.  With one shard (the default)
+// everything is on g_service like it always was.
+class Shards {
+public:
+	Shards();
+	~Shards();
+
+	// Starts count - 1 threads next to the main one, pinned to a CPU each.
+	// Only once, before any connection is made.
+	void start(size_t count);
+	void stop();
+
+	size_t count() const { return m_services.size() + 1; }
+	asio::io_service &next();
+
+private:
+	std::vector<std::unique_ptr<asio::io_service>> m_services;
+	std::vector<std::unique_ptr<asio::io_service::work>> m_work;
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_next;
+};
+
+extern Shards g_shards;
+
+#endif
@@ -102,6 +102,15 @@ std::string ip2str(uint32_t ip)
 	return buffer;
 }
 
+// Loopback, private (RFC 1918) or link-local, same byte order as ip2str()
+bool isLocalAddress(uint32_t ip)
+{
+	uint8_t a = ip & 0xFF;
+	uint8_t b = (ip >> 8) & 0xFF;
+	return a == 127 || a == 10 || (a == 172 && (b & 0xF0) == 16) ||
+		(a == 192 && b == 168) || (a == 169 && b == 254);
+}
+
 uint32_t str2ip(const std::string &ip)
 {
 	const uint8_t *c = (const uint8_t *)ip.c_str();
@@ -64,6 +64,7 @@ extern UrlData parseUrl(const std::string &str);
 extern std::string bytesToHumanReadable(uint32_t bytes, bool si);
 extern std::string ip2str(uint32_t ip);
 extern uint32_t str2ip(const std::string &ip);
+extern bool isLocalAddress(uint32_t ip);
 extern std::string getcwd();
 extern std::string urlencode(const std::string& url);
 
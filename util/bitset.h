@@ -26,6 +26,8 @@
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
+#include <assert.h>
+#include <atomic>
 #ifdef _MSC_VER
 #include <intrin.h>
 #endif
@@ -42,7 +44,7 @@ public:
 		m_bits = nullptr;
 	}
 	bitset(bitset const &) = delete;
-	~bitset() { delete m_bits; m_bits = nullptr; }
+	~bitset() { delete []m_bits; m_bits = nullptr; }
 
 	void construct(size_t size)
 	{
@@ -91,17 +93,17 @@ public:
 		size_t set = 0;
 		const uint8_t *src = m_bits;
 		const uint8_t *dst = m_bits + m_size;
-		while (src + 7 <= dst) {
+		while (src + 8 <= dst) {
 			set += popcnt(*(uint64_t *)src);
 			src += 8;
 		}
 
-		if (src + 3 <= dst) {
+		if (src + 4 <= dst) {
 			set += popcnt(*(uint32_t *)src);
 			src += 4;
 		}
 
-		if (src + 1 <= dst) {
+		if (src + 2 <= dst) {
 			set += popcnt(*(uint16_t *)src);
 			src += 2;
 		}
@@ -128,5 +130,77 @@ private:
 	size_t m_size;
 };
 
+// Same bit layout, but any thread may test, set or clear bits without a lock.
+// set() and clear() tell whether they changed anything, which keeps count()
+// a single load.
+class atomic_bitset {
+public:
+	atomic_bitset()
+	{
+		m_size = 0;
+		m_bits = nullptr;
+		m_count = 0;
+	}
+	atomic_bitset(atomic_bitset const &) = delete;
+	~atomic_bitset() { delete []m_bits; m_bits = nullptr; }
+
+	void construct(size_t size)
+	{
+		delete []m_bits;
+		m_size = size;
+		m_bits = new std::atomic<uint8_t>[m_size];
+		for (size_t i = 0; i < m_size; ++i)
+			m_bits[i].store(0, std::memory_order_relaxed);
+		m_count = 0;
+	}
+
+	bool test(size_t i) const { return !!(m_bits[i >> 3].load(std::memory_order_acquire) & (1 << (i & 7))); }
+	bool set(size_t i)
+	{
+		// Counted first so that a racing clear() can't take it below zero
+		uint8_t mask = 1 << (i & 7);
+		++m_count;
+		if (!(m_bits[i >> 3].fetch_or(mask, std::memory_order_acq_rel) & mask))
+			return true;
+
+		--m_count;
+		return false;
+	}
+	bool clear(size_t i)
+	{
+		uint8_t mask = 1 << (i & 7);
+		if (!(m_bits[i >> 3].fetch_and(~mask, std::memory_order_acq_rel) & mask))
+			return false;
+
+		--m_count;
+		return true;
+	}
+
+	bool operator[] (size_t i) const { return test(i); }
+
+	size_t size() const { return m_size; }
+	size_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+	// Plain copies, for saving and loading
+	void copy(bitset &out) const
+	{
+		out.construct(m_size);
+		for (size_t i = 0; i < m_size; ++i)
+			out.bits()[i] = m_bits[i].load(std::memory_order_relaxed);
+	}
+	void assign(const bitset &in)
+	{
+		assert(in.size() == m_size);
+		for (size_t i = 0; i < m_size; ++i)
+			m_bits[i].store(in.bits()[i], std::memory_order_relaxed);
+		m_count = in.count();
+	}
+
+private:
+	std::atomic<uint8_t> *m_bits;
+	std::atomic<size_t> m_count;
+	size_t m_size;
+};
+
 #endif
 
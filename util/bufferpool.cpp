@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "bufferpool.h"
+
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace {
+
+enum {
+	FirstLarge = 2,				// class of the 32 KiB buffers
+	NumClasses = FirstLarge + 12,		// up to MaxSize
+	ThreadCacheBytes = 1 << 20,
+	SharedBytes = 32 << 20
+};
+
+size_t classOf(size_t size)
+{
+	if (size <= BufferPool::SmallSize)
+		return 0;
+	if (size <= BufferPool::BlockSize)
+		return 1;
+
+	size_t c = FirstLarge;
+	for (size_t s = 32768; s < size; s <<= 1)
+		++c;
+	return c;
+}
+
+size_t classSize(size_t c)
+{
+	if (c == 0)
+		return BufferPool::SmallSize;
+	if (c == 1)
+		return BufferPool::BlockSize;
+
+	return (size_t)32768 << (c - FirstLarge);
+}
+
+// How many free buffers of a class a thread keeps, and how many are shared.
+// Classes bigger than the byte budget aren't kept at all.
+size_t threadLimit(size_t c) { return std::min<size_t>(ThreadCacheBytes / classSize(c), 64); }
+size_t sharedLimit(size_t c) { return std::min<size_t>(SharedBytes / classSize(c), 1024); }
+
+struct Shared {
+	std::mutex mutex;
+	std::vector<uint8_t *> free[NumClasses];
+	size_t bytes;			// held in free, never above SharedBytes
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+
+	Shared() : bytes(0), hits(0), misses(0) { }
+
+	void put(size_t c, uint8_t *buffer)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		if (free[c].size() < sharedLimit(c) && bytes + classSize(c) <= SharedBytes) {
+			free[c].push_back(buffer);
+			bytes += classSize(c);
+		} else
+			delete[] buffer;
+	}
+
+	uint8_t *take(size_t c)
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		if (free[c].empty())
+			return nullptr;
+
+		uint8_t *buffer = free[c].back();
+		free[c].pop_back();
+		bytes -= classSize(c);
+		return buffer;
+	}
+};
+
+// Never destroyed: threads that outlive static destruction (disk workers
+// are joined from a static destructor) still hand their caches back.
+Shared *shared()
+{
+	static Shared *s = new Shared;
+	return s;
+}
+
+// Buffers freed after the cache is gone (static destructors running on the
+// thread) go straight to the shared lists.
+thread_local bool cacheGone = false;
+
+struct ThreadCache {
+	std::vector<uint8_t *> free[NumClasses];
+	size_t bytes;			// never above ThreadCacheBytes
+
+	ThreadCache() : bytes(0) { }
+
+	~ThreadCache()
+	{
+		cacheGone = true;
+		for (size_t c = 0; c < NumClasses; ++c)
+			for (uint8_t *buffer : free[c])
+				shared()->put(c, buffer);
+	}
+};
+
+thread_local ThreadCache cache;
+
+}
+
+uint8_t *BufferPool::allocate(size_t &size)
+{
+	if (size == 0)
+		return nullptr;
+	if (size > MaxSize)
+		return new uint8_t[size];
+
+	size_t c = classOf(size);
+	size = classSize(c);
+
+	uint8_t *buffer = nullptr;
+	if (!cacheGone && !cache.free[c].empty()) {
+		buffer = cache.free[c].back();
+		cache.free[c].pop_back();
+		cache.bytes -= classSize(c);
+	} else
+		buffer = shared()->take(c);
+
+	if (buffer) {
+		shared()->hits.fetch_add(1, std::memory_order_relaxed);
+		return buffer;
+	}
+
+	shared()->misses.fetch_add(1, std::memory_order_relaxed);
+	return new uint8_t[size];
+}
+
+void BufferPool::release(uint8_t *buffer, size_t size)
+{
+	if (!buffer)
+		return;
+
+	if (size > MaxSize) {
+		delete[] buffer;
+		return;
+	}
+
+	size_t c = classOf(size);
+	if (!cacheGone && cache.free[c].size() < threadLimit(c) &&
+	    cache.bytes + classSize(c) <= ThreadCacheBytes) {
+		cache.free[c].push_back(buffer);
+		cache.bytes += classSize(c);
+	} else
+		shared()->put(c, buffer);
+}
+
+BufferPool::Counters BufferPool::counters()
+{
+	Counters counters = {
+		shared()->hits.load(std::memory_order_relaxed),
+		shared()->misses.load(std::memory_order_relaxed)
+	};
+	return counters;
+}
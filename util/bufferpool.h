@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __BUFFERPOOL_H
+#define __BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Recycles the buffers behind DataBuffer (and with it OutputMessage, piece
+// buffers and the disk path).  Sizes are rounded up to a class: small
+// control messages, one 16 KiB block plus its header, then powers of two up
+// to whole pieces.  Every thread keeps a few free buffers of each class to
+// itself and shares the rest, so a piece buffer filled on the network
+// thread and freed by a disk worker is found again on the next allocation.
+class BufferPool {
+public:
+	enum {
+		SmallSize = 256,
+		BlockSize = 16384 + 64,
+		MaxSize = 64 << 20		// anything bigger isn't pooled
+	};
+
+	struct Counters {
+		size_t hits;			// served from a free list
+		size_t misses;			// had to be allocated
+	};
+
+	// At least size bytes, size is set to what was really handed out.
+	// release() takes either size, only the class matters.
+	static uint8_t *allocate(size_t &size);
+	static void release(uint8_t *buffer, size_t size);
+
+	static Counters counters();
+};
+
+#endif
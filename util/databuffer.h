@@ -7,15 +7,21 @@
 #include <assert.h>
 
 #include <algorithm>
+#include <type_traits>
 
+#include "bufferpool.h"
+
+// Memory comes from BufferPool, so T has to be trivial and capacity ends up
+// rounded up to the pool's size class.
 template <typename T>
 class DataBuffer
 {
+	static_assert(std::is_trivial<T>::value, "DataBuffer holds plain data only");
+
 public:
 	DataBuffer(size_t res = 64)
 		: m_size(0),
-		  m_capacity(res),
-		  m_buffer(new T[m_capacity])
+		  m_buffer(allocate(res, m_capacity))
 	{
 	}
 	DataBuffer(DataBuffer<T> const &buf) = delete;
@@ -27,7 +33,7 @@ public:
 
 		buf.m_buffer = nullptr;
 	}
-	~DataBuffer() { delete[] m_buffer; m_buffer = nullptr; }
+	~DataBuffer() { release(m_buffer, m_capacity); m_buffer = nullptr; }
 
 	inline size_t size() const { return m_size; }
 	inline size_t cap() const { return m_capacity; }
@@ -61,8 +67,10 @@ public:
 
 	inline void setData(T *data, size_t size)
 	{
-		delete []m_buffer;
-		m_buffer = new T[size];
+		// Capacity stays exactly size, the decoder reads up to cap()
+		size_t capacity;
+		release(m_buffer, m_capacity);
+		m_buffer = allocate(size, capacity);
 		m_capacity = size;
 		m_size = 0;
 		for (size_t i = 0; i < size; ++i)
@@ -79,12 +87,13 @@ public:
 	inline void reserve(size_t n)
 	{
 		if (n > m_capacity) {
-			T *buffer = new T[n];
+			size_t capacity;
+			T *buffer = allocate(n, capacity);
 			for (size_t i=0; i<m_size; ++i)
 				buffer[i] = m_buffer[i];
-			delete[] m_buffer;
+			release(m_buffer, m_capacity);
 			m_buffer = buffer;
-			m_capacity = n;
+			m_capacity = capacity;
 		}
 	}
 
@@ -94,7 +103,7 @@ public:
 			return;
 
 		if (n > m_capacity) {
-			size_t newcapacity = m_capacity;
+			size_t newcapacity = m_capacity ? m_capacity : 1;
 			do
 				newcapacity *= 2;
 			while (newcapacity < n);
@@ -121,6 +130,19 @@ public:
 	}
 
 private:
+	static T *allocate(size_t n, size_t &capacity)
+	{
+		size_t bytes = n * sizeof(T);
+		T *buffer = (T *)BufferPool::allocate(bytes);
+		capacity = bytes / sizeof(T);
+		return buffer;
+	}
+
+	static void release(T *buffer, size_t capacity)
+	{
+		BufferPool::release((uint8_t *)buffer, capacity * sizeof(T));
+	}
+
 	size_t m_size;
 	size_t m_capacity;
 	T *m_buffer;
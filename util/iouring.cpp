@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "iouring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#endif
+
+IoUring::IoUring()
+	: m_fd(-1),
+	  m_entries(0),
+	  m_queued(0),
+	  m_inflight(0),
+	  m_sqRing(nullptr),
+	  m_cqRing(nullptr),
+	  m_sqRingSize(0),
+	  m_cqRingSize(0),
+	  m_sqes(nullptr),
+	  m_sqLocalTail(0)
+{
+}
+
+IoUring::~IoUring()
+{
+#ifdef HAVE_IO_URING
+	if (m_fd < 0)
+		return;
+
+	munmap(m_sqes, m_entries * sizeof(struct io_uring_sqe));
+	if (m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	munmap(m_sqRing, m_sqRingSize);
+	close(m_fd);
+#endif
+}
+
+bool IoUring::init(unsigned entries)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return false;
+
+	m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (m_cqRingSize > m_sqRingSize)
+			m_sqRingSize = m_cqRingSize;
+		m_cqRingSize = m_sqRingSize;
+	}
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		m_cqRing = m_sqRing;
+	else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			munmap(m_sqRing, m_sqRingSize);
+			close(fd);
+			return false;
+		}
+	}
+
+	m_sqes = mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		if (m_cqRing != m_sqRing)
+			munmap(m_cqRing, m_cqRingSize);
+		munmap(m_sqRing, m_sqRingSize);
+		close(fd);
+		return false;
+	}
+
+	uint8_t *sq = (uint8_t *)m_sqRing;
+	m_sqHead = (unsigned *)(sq + p.sq_off.head);
+	m_sqTail = (unsigned *)(sq + p.sq_off.tail);
+	m_sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	m_sqArray = (unsigned *)(sq + p.sq_off.array);
+	m_sqLocalTail = *m_sqTail;
+
+	uint8_t *cq = (uint8_t *)m_cqRing;
+	m_cqHead = (unsigned *)(cq + p.cq_off.head);
+	m_cqTail = (unsigned *)(cq + p.cq_off.tail);
+	m_cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	m_cqes = cq + p.cq_off.cqes;
+
+	m_entries = p.sq_entries;
+	m_fd = fd;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoUring::prepareReadv(int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+	return prepare(IORING_OP_READV, fd, iov, count, offset, userData);
+#else
+	return false;
+#endif
+}
+
+bool IoUring::prepareWritev(int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+	return prepare(IORING_OP_WRITEV, fd, iov, count, offset, userData);
+#else
+	return false;
+#endif
+}
+
+bool IoUring::prepare(uint8_t op, int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData)
+{
+#ifdef HAVE_IO_URING
+	if (m_fd < 0)
+		return false;
+
+	// Keep the number of requests in flight within what the completion
+	// queue is guaranteed to hold.
+	unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	if (m_sqLocalTail - head >= m_entries || m_inflight + m_queued >= m_entries)
+		return false;
+
+	unsigned index = m_sqLocalTail & *m_sqMask;
+	struct io_uring_sqe *sqe = &((struct io_uring_sqe *)m_sqes)[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = count;
+	sqe->user_data = userData;
+
+	m_sqArray[index] = index;
+	++m_sqLocalTail;
+	++m_queued;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoUring::submit(unsigned waitFor)
+{
+#ifdef HAVE_IO_URING
+	if (m_fd < 0)
+		return false;
+
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+	while (m_queued > 0 || waitFor > 0) {
+		int ret = syscall(__NR_io_uring_enter, m_fd, m_queued, waitFor,
+				  waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		m_inflight += ret;
+		m_queued -= ret;
+		break;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool IoUring::peek(uint64_t &userData, int &res)
+{
+#ifdef HAVE_IO_URING
+	if (m_fd < 0)
+		return false;
+
+	unsigned head = *m_cqHead;
+	if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+		return false;
+
+	const struct io_uring_cqe *cqe = &((const struct io_uring_cqe *)m_cqes)[head & *m_cqMask];
+	userData = cqe->user_data;
+	res = cqe->res;
+
+	__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+	--m_inflight;
+	return true;
+#else
+	return false;
+#endif
+}
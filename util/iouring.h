@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __IOURING_H
+#define __IOURING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct iovec;
+
+// Minimal io_uring(7) wrapper talking to the kernel directly, so there is no
+// dependency on liburing.  init() fails on kernels (or platforms) without
+// io_uring and the caller is expected to fall back to blocking I/O.
+class IoUring {
+public:
+	IoUring();
+	~IoUring();
+
+	bool init(unsigned entries);
+	bool valid() const { return m_fd >= 0; }
+	unsigned queued() const { return m_queued; }
+	unsigned inflight() const { return m_inflight; }
+
+	// Queue a readv/writev, userData is handed back on completion.
+	// Returns false when the submission queue is full.
+	bool prepareReadv(int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData);
+	bool prepareWritev(int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData);
+
+	// Submit everything queued so far and wait for at least waitFor completions
+	bool submit(unsigned waitFor = 0);
+
+	// Reap one completion, res is the syscall-style result (-errno on failure)
+	bool peek(uint64_t &userData, int &res);
+
+private:
+	bool prepare(uint8_t op, int fd, const struct iovec *iov, unsigned count, uint64_t offset, uint64_t userData);
+
+	int m_fd;
+	unsigned m_entries;
+	unsigned m_queued;
+	unsigned m_inflight;
+
+	void *m_sqRing;
+	void *m_cqRing;
+	size_t m_sqRingSize;
+	size_t m_cqRingSize;
+	void *m_sqes;
+
+	unsigned *m_sqHead;
+	unsigned *m_sqTail;
+	unsigned *m_sqMask;
+	unsigned *m_sqArray;
+	unsigned m_sqLocalTail;
+
+	unsigned *m_cqHead;
+	unsigned *m_cqTail;
+	unsigned *m_cqMask;
+	void *m_cqes;
+};
+
+#endif
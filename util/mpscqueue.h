@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __MPSCQUEUE_H
+#define __MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded queue, any thread may push, only one thread pops.  Producers
+// swap themselves in at the head and link the previous node after, so a
+// push that is halfway through hides everything behind it until it is done:
+// pop() then fails while empty() is still false.
+template <typename T>
+class MPSCQueue
+{
+public:
+	MPSCQueue()
+		: m_head(&m_stub),
+		  m_tail(&m_stub)
+	{
+		m_stub.next.store(nullptr, std::memory_order_relaxed);
+	}
+	~MPSCQueue()
+	{
+		T v;
+		while (pop(v));
+		if (m_tail != &m_stub)
+			delete m_tail;
+	}
+
+	MPSCQueue(const MPSCQueue &) = delete;
+	MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+	void push(T &&v)
+	{
+		Node *node = new Node(std::move(v));
+		Node *prev = m_head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// Consumer only
+	bool pop(T &v)
+	{
+		Node *tail = m_tail;
+		Node *next = tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+
+		v = std::move(next->value);
+		m_tail = next;
+		if (tail != &m_stub)
+			delete tail;
+		return true;
+	}
+
+	bool empty() const { return m_head.load(std::memory_order_acquire) == m_tail; }
+
+private:
+	struct Node {
+		Node() { }
+		Node(T &&v) : next(nullptr), value(std::move(v)) { }
+
+		std::atomic<Node *> next;
+		T value;
+	};
+
+	std::atomic<Node *> m_head;
+	Node *m_tail;
+	Node m_stub;
+};
+
+#endif
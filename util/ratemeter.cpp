@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ratemeter.h"
+
+#include <math.h>
+
+static const double timeConstants[RateMeter::Windows] = { 1.0, 10.0, 60.0 };
+
+RateMeter::RateMeter(RateMeter *parent)
+	: m_parent(parent),
+	  m_total(0),
+	  m_lastTotal(0),
+	  m_lastTick(Clock::now())
+{
+	for (std::atomic<double> &r : m_rates)
+		r.store(0.0, std::memory_order_relaxed);
+}
+
+void RateMeter::add(size_t bytes)
+{
+	for (RateMeter *m = this; m; m = m->m_parent)
+		m->m_total.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void RateMeter::tick()
+{
+	// Meters shared by several tickers (the session's) only move once
+	Clock::time_point now = Clock::now();
+	std::chrono::duration<double> elapsed = now - m_lastTick;
+	if (elapsed < std::chrono::milliseconds(TickInterval / 2))
+		return;
+
+	uint64_t total = m_total.load(std::memory_order_relaxed);
+	double sample = (total - m_lastTotal) / elapsed.count();
+	for (int w = 0; w < Windows; ++w) {
+		double rate = m_rates[w].load(std::memory_order_relaxed);
+		double alpha = 1.0 - exp(-elapsed.count() / timeConstants[w]);
+		m_rates[w].store(rate + alpha * (sample - rate), std::memory_order_relaxed);
+	}
+
+	m_lastTotal = total;
+	m_lastTick = now;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RATEMETER_H
+#define __RATEMETER_H
+
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+// Transfer rate over wall time, as exponentially weighted averages with 1,
+// 10 and 60 second time constants.  Any thread may add() bytes, tick() folds
+// them into the averages and must be called from one thread, about every
+// TickInterval.  Meters can be chained so that a peer's bytes also count for
+// its torrent and the session.
+class RateMeter {
+public:
+	enum Window {
+		Short,			// 1 s
+		Medium,			// 10 s
+		Long,			// 60 s
+		Windows
+	};
+
+	enum {
+		TickInterval = 1000	// ms
+	};
+
+	explicit RateMeter(RateMeter *parent = nullptr);
+
+	void add(size_t bytes);
+	void tick();
+
+	// Bytes per second
+	double rate(Window w = Medium) const { return m_rates[w].load(std::memory_order_relaxed); }
+	uint64_t total() const { return m_total.load(std::memory_order_relaxed); }
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	RateMeter *m_parent;
+	std::atomic<uint64_t> m_total;
+	std::atomic<double> m_rates[Windows];
+
+	// tick() only
+	uint64_t m_lastTotal;
+	Clock::time_point m_lastTick;
+};
+
+#endif
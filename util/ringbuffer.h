@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __RINGBUFFER_H
+#define __RINGBUFFER_H
+
+#include "databuffer.h"
+
+// Byte FIFO over a power of two sized buffer.  Data is read into the free
+// space at the back and taken off the front, a run that wraps around the
+// end is copied to one piece when it has to be seen whole.
+class RingBuffer
+{
+public:
+	RingBuffer(size_t capacity)
+		: m_buffer(capacity),
+		  m_scratch(0),
+		  m_head(0),
+		  m_tail(0)
+	{
+		// The pool may round up, but only to another power of two
+		m_mask = m_buffer.cap() - 1;
+		assert((m_buffer.cap() & m_mask) == 0);
+	}
+
+	inline size_t size() const { return m_tail - m_head; }
+	inline size_t space() const { return m_buffer.cap() - size(); }
+
+	// Contiguous free space at the back, commit() what was put there
+	inline uint8_t *reserve(size_t &len)
+	{
+		size_t pos = m_tail & m_mask;
+		len = std::min(space(), m_buffer.cap() - pos);
+		return &m_buffer[pos];
+	}
+	inline void commit(size_t n) { m_tail += n; }
+
+	// Copy n bytes starting at offset from the front, without taking them
+	void peek(size_t offset, uint8_t *out, size_t n) const
+	{
+		size_t pos = (m_head + offset) & m_mask;
+		size_t first = std::min(n, m_buffer.cap() - pos);
+		memcpy(out, &m_buffer[pos], first);
+		memcpy(out + first, &m_buffer[0], n - first);
+	}
+
+	// The first n bytes in one piece, valid until the next call
+	uint8_t *front(size_t n)
+	{
+		size_t pos = m_head & m_mask;
+		if (pos + n <= m_buffer.cap())
+			return &m_buffer[pos];
+
+		m_scratch.reserve(n);
+		peek(0, m_scratch.data(), n);
+		return m_scratch.data();
+	}
+
+	inline void consume(size_t n) { m_head += n; }
+
+private:
+	DataBuffer<uint8_t> m_buffer;
+	DataBuffer<uint8_t> m_scratch;
+	size_t m_mask;
+	size_t m_head;		// both only ever grow, masked on use
+	size_t m_tail;
+};
+
+#endif
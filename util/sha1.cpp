@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "sha1.h"
+#include "serializer.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SHA1
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define TARGET_SHANI	__attribute__((target("sha,sse4.1")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+
+typedef void (*Sha1Compress)(uint32_t state[5], const uint8_t *data, size_t blocks);
+typedef void (*Sha1Compress8)(uint32_t state[8][5], const uint8_t *const data[8], size_t blocks);
+
+struct Sha1Engine {
+	const char *name;
+	Sha1Compress compress;
+	Sha1Compress8 compress8;	// multi-buffer, nullptr if there is none
+	bool (*supported)();
+};
+
+static const uint32_t initialState[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static inline uint32_t rol(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+static void compressScalar(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	uint32_t w[80];
+
+	for (; blocks > 0; --blocks, data += 64) {
+		for (int i = 0; i < 16; ++i)
+			w[i] = readBE32(&data[i * 4]);
+		for (int i = 16; i < 80; ++i)
+			w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (int i = 0; i < 80; ++i) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			uint32_t t = rol(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rol(b, 30);
+			b = a;
+			a = t;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+static bool supportedAlways()
+{
+	return true;
+}
+
+#ifdef HAVE_X86_SHA1
+static bool supportedShaNi()
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) || !(c & bit_SSE4_1))
+		return false;
+
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 29));
+}
+
+static bool supportedAvx2()
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_OSXSAVE) || !(c & bit_AVX))
+		return false;
+
+	// The OS has to save the YMM registers for us
+	unsigned lo, hi;
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	if ((lo & 6) != 6)
+		return false;
+
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2);
+}
+
+// One group of 4 rounds from 12 on.  Message words for group n + 1 are
+// finished, n + 2 and n + 3 are prepared; past the end that's wasted work
+// but harmless.
+#define SHANI_ROUNDS(E, F, M, M1, M2, M3, func)			\
+	E = _mm_sha1nexte_epu32(E, M);				\
+	F = abcd;						\
+	M1 = _mm_sha1msg2_epu32(M1, M);				\
+	abcd = _mm_sha1rnds4_epu32(abcd, E, func);		\
+	M3 = _mm_sha1msg1_epu32(M3, M);				\
+	M2 = _mm_xor_si128(M2, M)
+
+TARGET_SHANI static void compressShaNi(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+	__m128i e1;
+	__m128i m0, m1, m2, m3;
+
+	for (; blocks > 0; --blocks, data += 64) {
+		__m128i abcdSave = abcd;
+		__m128i e0Save = e0;
+
+		// Rounds 0-11 load the message as they go
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), mask);
+		e0 = _mm_add_epi32(e0, m0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+		e1 = _mm_sha1nexte_epu32(e1, m1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		m0 = _mm_sha1msg1_epu32(m0, m1);
+
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+		e0 = _mm_sha1nexte_epu32(e0, m2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		m1 = _mm_sha1msg1_epu32(m1, m2);
+		m0 = _mm_xor_si128(m0, m2);
+
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+		SHANI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+		SHANI_ROUNDS(e1, e0, m1, m2, m3, m0, 3);
+		SHANI_ROUNDS(e0, e1, m2, m3, m0, m1, 3);
+		SHANI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0Save);
+		abcd = _mm_add_epi32(abcd, abcdSave);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+TARGET_AVX2 static inline __m256i rol8(__m256i v, int n)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+}
+
+// r[i] holds 8 words of lane i, on return r[i] holds word i of every lane
+TARGET_AVX2 static inline void transpose8(__m256i r[8])
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// 8 independent messages of the same length, one per 32-bit lane
+TARGET_AVX2 static void compressAvx2(uint32_t state[8][5], const uint8_t *const data[8], size_t blocks)
+{
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+					      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m256i k0 = _mm256_set1_epi32(0x5a827999);
+	const __m256i k1 = _mm256_set1_epi32(0x6ed9eba1);
+	const __m256i k2 = _mm256_set1_epi32(0x8f1bbcdc);
+	const __m256i k3 = _mm256_set1_epi32(0xca62c1d6);
+
+	__m256i h[5];
+	for (int i = 0; i < 5; ++i)
+		h[i] = _mm256_set_epi32(state[7][i], state[6][i], state[5][i], state[4][i],
+					state[3][i], state[2][i], state[1][i], state[0][i]);
+
+	for (size_t block = 0; block < blocks; ++block) {
+		size_t offset = block * 64;
+		__m256i w[16];
+
+		for (int half = 0; half < 2; ++half) {
+			__m256i *r = &w[half * 8];
+			for (int lane = 0; lane < 8; ++lane)
+				r[lane] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data[lane] + offset + half * 32)), bswap);
+			transpose8(r);
+		}
+
+		__m256i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; ++i) {
+			__m256i wi;
+			if (i < 16)
+				wi = w[i];
+			else {
+				wi = _mm256_xor_si256(_mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]),
+						      _mm256_xor_si256(w[(i - 14) & 15], w[i & 15]));
+				wi = rol8(wi, 1);
+				w[i & 15] = wi;
+			}
+
+			__m256i f, k;
+			if (i < 20) {
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+				k = k0;
+			} else if (i < 40) {
+				f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+				k = k1;
+			} else if (i < 60) {
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+				k = k2;
+			} else {
+				f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+				k = k3;
+			}
+
+			__m256i t = _mm256_add_epi32(_mm256_add_epi32(rol8(a, 5), f),
+						     _mm256_add_epi32(_mm256_add_epi32(e, k), wi));
+			e = d;
+			d = c;
+			c = rol8(b, 30);
+			b = a;
+			a = t;
+		}
+
+		h[0] = _mm256_add_epi32(h[0], a);
+		h[1] = _mm256_add_epi32(h[1], b);
+		h[2] = _mm256_add_epi32(h[2], c);
+		h[3] = _mm256_add_epi32(h[3], d);
+		h[4] = _mm256_add_epi32(h[4], e);
+	}
+
+	for (int i = 0; i < 5; ++i) {
+		uint32_t words[8];
+		_mm256_storeu_si256((__m256i *)words, h[i]);
+		for (int lane = 0; lane < 8; ++lane)
+			state[lane][i] = words[lane];
+	}
+}
+#endif
+
+// In order of preference
+static const Sha1Engine sha1Engines[] = {
+#ifdef HAVE_X86_SHA1
+	{ "shani", compressShaNi, nullptr, supportedShaNi },
+	{ "avx2", compressScalar, compressAvx2, supportedAvx2 },
+#endif
+	{ "scalar", compressScalar, nullptr, supportedAlways },
+};
+
+static const Sha1Engine *findEngine(const std::string &name)
+{
+	for (const Sha1Engine &e : sha1Engines)
+		if (name == e.name && e.supported())
+			return &e;
+
+	return nullptr;
+}
+
+// The best engine that the CPU supports and that gets the right answers
+static const Sha1Engine *&currentEngine()
+{
+	static const Sha1Engine *engine = [] () {
+		for (const Sha1Engine &e : sha1Engines)
+			if (e.supported() && Sha1::selfTest(e.name))
+				return &e;
+
+		return &sha1Engines[sizeof(sha1Engines) / sizeof(sha1Engines[0]) - 1];
+	}();
+
+	return engine;
+}
+
+Sha1::Sha1()
+	: Sha1(currentEngine())
+{
+}
+
+Sha1::Sha1(const Sha1Engine *engine)
+	: m_engine(engine)
+{
+	reset();
+}
+
+void Sha1::reset()
+{
+	memcpy(m_state, initialState, sizeof(m_state));
+	m_size = 0;
+}
+
+void Sha1::update(const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t used = m_size & 63;
+
+	m_size += size;
+	if (used) {
+		size_t n = std::min(64 - used, size);
+		memcpy(&m_buffer[used], p, n);
+		p += n;
+		size -= n;
+		if (used + n < 64)
+			return;
+
+		m_engine->compress(m_state, m_buffer, 1);
+	}
+
+	if (size >= 64) {
+		m_engine->compress(m_state, p, size / 64);
+		p += size & ~(size_t)63;
+		size &= 63;
+	}
+
+	if (size)
+		memcpy(m_buffer, p, size);
+}
+
+void Sha1::finish(uint32_t digest[5])
+{
+	uint8_t pad[72] = { 0x80 };
+	size_t used = m_size & 63;
+	size_t padSize = used < 56 ? 56 - used : 120 - used;
+
+	writeBE64(&pad[padSize], m_size * 8);
+	update(pad, padSize + 8);
+
+	memcpy(digest, m_state, sizeof(m_state));
+}
+
+void Sha1::hash(const void *data, size_t size, uint32_t digest[5])
+{
+	Sha1 sha1;
+	sha1.update(data, size);
+	sha1.finish(digest);
+}
+
+void Sha1::hashMany(const uint8_t *const data[], const size_t sizes[], size_t count, uint32_t (*digests)[5])
+{
+	hashMany(currentEngine(), data, sizes, count, digests);
+}
+
+void Sha1::hashMany(const Sha1Engine *engine, const uint8_t *const data[], const size_t sizes[], size_t count, uint32_t (*digests)[5])
+{
+	size_t i = 0;
+
+	// Whole blocks all the lanes have go through the multi-buffer path,
+	// tails are finished one at a time.  Unused lanes just repeat the first.
+	while (engine->compress8 && count - i >= 2) {
+		size_t n = std::min<size_t>(count - i, 8);
+		size_t blocks = sizes[i] / 64;
+		for (size_t lane = 1; lane < n; ++lane)
+			blocks = std::min(blocks, sizes[i + lane] / 64);
+
+		uint32_t state[8][5];
+		const uint8_t *ptrs[8];
+		for (size_t lane = 0; lane < 8; ++lane) {
+			memcpy(state[lane], initialState, sizeof(initialState));
+			ptrs[lane] = data[lane < n ? i + lane : i];
+		}
+
+		engine->compress8(state, ptrs, blocks);
+		for (size_t lane = 0; lane < n; ++lane) {
+			Sha1 sha1(engine);
+			memcpy(sha1.m_state, state[lane], sizeof(sha1.m_state));
+			sha1.m_size = blocks * 64;
+			sha1.update(data[i + lane] + blocks * 64, sizes[i + lane] - blocks * 64);
+			sha1.finish(digests[i + lane]);
+		}
+
+		i += n;
+	}
+
+	for (; i < count; ++i) {
+		Sha1 sha1(engine);
+		sha1.update(data[i], sizes[i]);
+		sha1.finish(digests[i]);
+	}
+}
+
+size_t Sha1::lanes()
+{
+	return currentEngine()->compress8 ? 8 : 1;
+}
+
+const char *Sha1::engineName()
+{
+	return currentEngine()->name;
+}
+
+std::vector<std::string> Sha1::engines()
+{
+	std::vector<std::string> ret;
+	for (const Sha1Engine &e : sha1Engines)
+		if (e.supported())
+			ret.push_back(e.name);
+
+	return ret;
+}
+
+bool Sha1::useEngine(const std::string &name)
+{
+	const Sha1Engine *engine = findEngine(name);
+	if (!engine)
+		return false;
+
+	currentEngine() = engine;
+	return true;
+}
+
+bool Sha1::selfTest(const std::string &name)
+{
+	const Sha1Engine *engine = findEngine(name);
+	if (!engine)
+		return false;
+
+	static const struct {
+		const char *message;
+		size_t repeat;
+		uint32_t digest[5];
+	} vectors[] = {
+		{ "", 1, { 0xda39a3ee, 0x5e6b4b0d, 0x3255bfef, 0x95601890, 0xafd80709 } },
+		{ "abc", 1, { 0xa9993e36, 0x4706816a, 0xba3e2571, 0x7850c26c, 0x9cd0d89d } },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+		  { 0x84983e44, 0x1c3bd26e, 0xbaae4aa1, 0xf95129e5, 0xe54670f1 } },
+		{ "a", 1000000, { 0x34aa973c, 0xd4c4daa4, 0xf61eeb2b, 0xdbad2731, 0x6534016f } },
+	};
+
+	for (const auto &v : vectors) {
+		size_t length = strlen(v.message);
+		std::string message;
+		message.reserve(length * v.repeat);
+		for (size_t i = 0; i < v.repeat; ++i)
+			message.append(v.message, length);
+
+		const uint8_t *data = (const uint8_t *)message.data();
+		size_t size = message.size();
+		uint32_t digest[5];
+
+		Sha1 sha1(engine);
+		sha1.update(data, size);
+		sha1.finish(digest);
+		if (memcmp(digest, v.digest, sizeof(digest)) != 0)
+			return false;
+	}
+
+	// Compare against the portable code on lengths around block boundaries,
+	// in lane counts that leave some of the multi-buffer lanes unused.
+	const Sha1Engine *reference = &sha1Engines[sizeof(sha1Engines) / sizeof(sha1Engines[0]) - 1];
+	const size_t sizes[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 1000, 4096, 4097, 16384 };
+	const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[16384 + count]);
+	uint32_t seed = 0x12345678;
+	for (size_t i = 0; i < 16384 + count; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+
+	const uint8_t *data[count];
+	for (size_t i = 0; i < count; ++i)
+		data[i] = &buffer[i];
+
+	for (size_t n = 1; n <= count; n += 3) {
+		uint32_t expected[count][5], digests[count][5];
+		hashMany(reference, data, sizes, n, expected);
+		hashMany(engine, data, sizes, n, digests);
+		if (memcmp(expected, digests, n * sizeof(digests[0])) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+double Sha1::benchmark(const std::string &name, size_t size)
+{
+	const Sha1Engine *engine = findEngine(name);
+	if (!engine || size == 0)
+		return 0;
+
+	size_t lanes = engine->compress8 ? 8 : 1;
+	std::unique_ptr<uint8_t[]> buffer(new uint8_t[lanes * size]);
+	memset(buffer.get(), 0x5a, lanes * size);
+
+	std::vector<const uint8_t *> data(lanes);
+	std::vector<size_t> sizes(lanes, size);
+	std::unique_ptr<uint32_t[][5]> digests(new uint32_t[lanes][5]);
+	for (size_t i = 0; i < lanes; ++i)
+		data[i] = &buffer[i * size];
+
+	// Run for about half a second
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed;
+	size_t total = 0;
+	do {
+		hashMany(engine, data.data(), sizes.data(), lanes, digests.get());
+		total += lanes * size;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < 0.5);
+
+	return total / elapsed.count() / 1e6;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __SHA1_H
+#define __SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+struct Sha1Engine;
+
+// SHA-1 with the compression function picked at runtime: SHA-NI where the
+// CPU has it, otherwise the portable one.  Independent buffers (e.g. pieces
+// during a recheck) can be hashed side by side with hashMany(), which uses
+// the AVX2 multi-buffer path when that is the selected engine.
+//
+// Digests are 5 host order words, same as boost's sha1::get_digest().
+class Sha1 {
+public:
+	Sha1();
+
+	void reset();
+	void update(const void *data, size_t size);
+	void finish(uint32_t digest[5]);
+
+	static void hash(const void *data, size_t size, uint32_t digest[5]);
+	static void hashMany(const uint8_t *const data[], const size_t sizes[], size_t count, uint32_t (*digests)[5]);
+
+	// Buffers hashMany() handles at once, 1 if there is no multi-buffer engine
+	static size_t lanes();
+
+	static const char *engineName();
+	static std::vector<std::string> engines();	// those this CPU supports
+	static bool useEngine(const std::string &name);	// not while hashing
+
+	// Check an engine against known vectors and the portable one, and
+	// measure its throughput in MB/s (through hashMany())
+	static bool selfTest(const std::string &name);
+	static double benchmark(const std::string &name, size_t size);
+
+private:
+	explicit Sha1(const Sha1Engine *engine);
+	static void hashMany(const Sha1Engine *engine, const uint8_t *const data[], const size_t sizes[], size_t count, uint32_t (*digests)[5]);
+
+	uint32_t m_state[5];
+	uint64_t m_size;
+	uint8_t m_buffer[64];
+	const Sha1Engine *m_engine;
+};
+
+#endif
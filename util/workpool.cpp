@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "workpool.h"
+
+#include <algorithm>
+
+WorkPool::WorkPool()
+	: m_next(0),
+	  m_unclaimed(0),
+	  m_stopped(false)
+{
+}
+
+WorkPool::~WorkPool()
+{
+	stop();
+}
+
+void WorkPool::setWorkers(size_t workers)
+{
+	if (workers == 0)
+		workers = std::max(1U, std::thread::hardware_concurrency());
+
+	stop();
+	m_stopped = false;
+	m_queues.clear();
+	for (size_t i = 0; i < workers; ++i)
+		m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+	for (size_t i = 0; i < workers; ++i)
+		m_threads.push_back(std::thread(std::bind(&WorkPool::worker, this, i)));
+}
+
+void WorkPool::stop()
+{
+	m_mutex.lock();
+	m_stopped = true;
+	m_mutex.unlock();
+	m_condition.notify_all();
+
+	for (std::thread &t : m_threads)
+		t.join();
+	m_threads.clear();
+}
+
+void WorkPool::push(Job &&job)
+{
+	if (m_threads.empty())
+		setWorkers(0);
+
+	Queue *q = m_queues[m_next++ % m_queues.size()].get();
+	q->mutex.lock();
+	q->jobs.push_back(std::move(job));
+	q->mutex.unlock();
+
+	m_mutex.lock();
+	++m_unclaimed;
+	m_mutex.unlock();
+	m_condition.notify_one();
+}
+
+bool WorkPool::pop(size_t self, Job &job)
+{
+	for (size_t i = 0; i < m_queues.size(); ++i) {
+		Queue *q = m_queues[(self + i) % m_queues.size()].get();
+		std::lock_guard<std::mutex> guard(q->mutex);
+		if (q->jobs.empty())
+			continue;
+
+		if (i == 0) {
+			job = std::move(q->jobs.front());
+			q->jobs.pop_front();
+		} else {
+			job = std::move(q->jobs.back());
+			q->jobs.pop_back();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void WorkPool::worker(size_t self)
+{
+	Job job;
+	for (;;) {
+		if (pop(self, job)) {
+			m_mutex.lock();
+			--m_unclaimed;
+			m_mutex.unlock();
+
+			job();
+			job = nullptr;
+			continue;
+		}
+
+		// Queued jobs are still run after stop()
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_unclaimed <= 0 && !m_stopped)
+			m_condition.wait(lock);
+		if (m_unclaimed <= 0 && m_stopped)
+			break;
+	}
+}
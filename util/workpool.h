@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2015 Ahmed Samy  <f.fallen45@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __WORKPOOL_H
+#define __WORKPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Fixed set of threads for CPU bound jobs.  Every thread has its own queue,
+// new jobs are spread over them in turn and a thread that runs dry steals
+// from the back of the others.
+class WorkPool {
+public:
+	typedef std::function<void ()> Job;
+
+	WorkPool();
+	~WorkPool();
+
+	// 0 means one per hardware thread
+	void setWorkers(size_t workers);
+	size_t workers() const { return m_threads.size(); }
+
+	void push(Job &&job);
+
+protected:
+	struct Queue {
+		std::deque<Job> jobs;
+		std::mutex mutex;
+	};
+
+	void worker(size_t self);
+	bool pop(size_t self, Job &job);
+	void stop();
+
+private:
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+	std::atomic<size_t> m_next;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	long m_unclaimed;	// jobs queued but not picked up, may dip below 0
+	bool m_stopped;
+};
+
+#endif